@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <time.h>
+#include "bench_report.h"
+
+double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void bench_header(void) {
+  printf("%-18s %-10s %8s %12s %10s %10s %10s %10s %8s %8s\n",
+         "image", "bench", "ops", "ops/s", "MB/s", "rd/op", "wr/op", "blk/op", "hit%", "fat%");
+}
+
+void bench_line(const char* image, const char* name, uint32_t ops, double seconds,
+                uint64_t bytes, const bench_counts* counts) {
+  double perOp = ops ? 1.0 / ops : 0;
+  uint32_t lookups = counts->cacheHits_ + counts->cacheMisses_;
+  uint32_t fatLookups = counts->fatCacheHits_ + counts->fatCacheMisses_;
+  printf("%-18s %-10s %8u %12.0f %10.2f %10.3f %10.3f %10.3f %8.1f %8.1f\n",
+         image, name, ops, seconds > 0 ? ops / seconds : 0,
+         seconds > 0 ? bytes / seconds / 1e6 : 0,
+         counts->reads_ * perOp, counts->writes_ * perOp,
+         (counts->blocksRead_ + counts->blocksWritten_) * perOp,
+         lookups ? 100.0 * counts->cacheHits_ / lookups : 0,
+         fatLookups ? 100.0 * counts->fatCacheHits_ / fatLookups : 0);
+}
+
+void bench_error(const char* image, const char* what) {
+  fprintf(stderr, "%s: %s failed\n", image, what);
+}
+
+void bench_path(char* dst, uint32_t size, const char* dir, const char* image) {
+  snprintf(dst, size, "%s/%s.img", dir, image);
+}
+
+void bench_remove(const char* path) {
+  remove(path);
+}
@@ -0,0 +1,35 @@
+#ifndef __BENCH_REPORT_H
+#define __BENCH_REPORT_H
+
+#include <stdint.h>
+
+/** Device traffic seen by one benchmark */
+typedef struct __BENCH_COUNTS_PROT
+{
+  uint32_t reads_;
+  uint32_t writes_;
+  uint32_t blocksRead_;
+  uint32_t blocksWritten_;
+  // volume block cache lookups
+  uint32_t cacheHits_;
+  uint32_t cacheMisses_;
+  uint32_t fatCacheHits_;
+  uint32_t fatCacheMisses_;
+} bench_counts;
+
+// Printing lives in its own translation unit because sd_file.h declares
+// rewind(), sync() and truncate() which collide with stdio and unistd.
+#ifdef __cplusplus
+extern "C" {
+#endif
+double bench_now(void);
+void bench_header(void);
+void bench_line(const char* image, const char* name, uint32_t ops, double seconds,
+                uint64_t bytes, const bench_counts* counts);
+void bench_error(const char* image, const char* what);
+void bench_path(char* dst, uint32_t size, const char* dir, const char* image);
+void bench_remove(const char* path);
+#ifdef __cplusplus
+}
+#endif
+#endif
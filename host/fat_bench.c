@@ -0,0 +1,683 @@
+// Host benchmark of the FAT layer. Every run generates the images it
+// measures so results are comparable between commits.
+#include <stdlib.h>
+#include <string.h>
+#include "sd_file.h"
+#include "file_disk.h"
+#include "ram_disk.h"
+#include "fat_image.h"
+#include "bench_report.h"
+
+/** Block device wrapper that counts the traffic reaching base_ */
+typedef struct __COUNTING_DEV_PROT
+{
+  block_dev* base_;
+  bench_counts counts_;
+  // multi-block writes from dataStart_ on that did not wait for programming
+  uint32_t dataStart_;
+  uint32_t nonBlockingRuns_;
+} counting_dev;
+
+static uint8_t countReadData(void* ctx, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+  counting_dev* c = (counting_dev*)ctx;
+  c->counts_.reads_++;
+  c->counts_.blocksRead_++;
+  return c->base_->ops_->readData(c->base_->ctx_, block, offset, count, dst);
+}
+
+static uint8_t countReadBlock(void* ctx, uint32_t block, uint8_t* dst) {
+  counting_dev* c = (counting_dev*)ctx;
+  c->counts_.reads_++;
+  c->counts_.blocksRead_++;
+  return c->base_->ops_->readBlock(c->base_->ctx_, block, dst);
+}
+
+static uint8_t countWriteBlock(void* ctx, uint32_t block, const uint8_t* src, uint8_t blocking) {
+  counting_dev* c = (counting_dev*)ctx;
+  c->counts_.writes_++;
+  c->counts_.blocksWritten_++;
+  return c->base_->ops_->writeBlock(c->base_->ctx_, block, src, blocking);
+}
+
+static uint8_t countReadBlocks(void* ctx, uint32_t block, uint32_t count, uint8_t* dst) {
+  counting_dev* c = (counting_dev*)ctx;
+  c->counts_.reads_++;
+  c->counts_.blocksRead_ += count;
+  return c->base_->ops_->readBlocks(c->base_->ctx_, block, count, dst);
+}
+
+static uint8_t countWriteBlocks(void* ctx, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+  counting_dev* c = (counting_dev*)ctx;
+  c->counts_.writes_++;
+  c->counts_.blocksWritten_ += count;
+  if (!blocking && count > 1 && block >= c->dataStart_) {
+    c->nonBlockingRuns_++;
+  }
+  return c->base_->ops_->writeBlocks(c->base_->ctx_, block, count, src, blocking);
+}
+
+static uint8_t countSync(void* ctx) {
+  counting_dev* c = (counting_dev*)ctx;
+  return c->base_->ops_->sync(c->base_->ctx_);
+}
+
+static uint32_t countSectorCount(void* ctx) {
+  counting_dev* c = (counting_dev*)ctx;
+  return c->base_->ops_->sectorCount(c->base_->ctx_);
+}
+
+static const block_dev_ops countOps = {
+  countReadData,
+  countReadBlock,
+  countWriteBlock,
+  countReadBlocks,
+  countWriteBlocks,
+  countSync,
+  countSectorCount
+};
+
+// state of the image being measured
+typedef struct {
+  const char* name;
+  const fat_image_params* params;
+  counting_dev count;
+  sd_volume vol;
+  sd_file root;
+  sd_file dir;
+  uint32_t seed;
+} bench;
+
+static uint32_t nextRandom(bench* b) {
+  b->seed = b->seed * 1103515245 + 12345;
+  return b->seed >> 8;
+}
+
+static void startCounts(bench* b, double* t) {
+  memset(&b->count.counts_, 0, sizeof(bench_counts));
+  b->count.counts_.cacheHits_ = -cacheHits(&b->vol);
+  b->count.counts_.cacheMisses_ = -cacheMisses(&b->vol);
+  b->count.counts_.fatCacheHits_ = -fatCacheHits(&b->vol);
+  b->count.counts_.fatCacheMisses_ = -fatCacheMisses(&b->vol);
+  *t = bench_now();
+}
+
+// counts since startCounts()
+static const bench_counts* counts(bench* b) {
+  b->count.counts_.cacheHits_ += cacheHits(&b->vol);
+  b->count.counts_.cacheMisses_ += cacheMisses(&b->vol);
+  b->count.counts_.fatCacheHits_ += fatCacheHits(&b->vol);
+  b->count.counts_.fatCacheMisses_ += fatCacheMisses(&b->vol);
+  return &b->count.counts_;
+}
+
+static void dirFileName(uint32_t i, char* name) {
+  memcpy(name, "F0000.BIN", 10);
+  name[1] = '0' + (i / 1000) % 10;
+  name[2] = '0' + (i / 100) % 10;
+  name[3] = '0' + (i / 10) % 10;
+  name[4] = '0' + i % 10;
+}
+
+// open random files of DIR by name, through a name index of slots
+// entries if slots is not zero
+static uint8_t benchOpen(bench* b, const char* name, uint32_t slots) {
+  const uint32_t ops = 500;
+  sd_dir_slot* index = NULL;
+  if (slots) {
+    index = malloc(slots * sizeof(sd_dir_slot));
+    if (!index) {
+      return false;
+    }
+  }
+  setDirIndex(&b->dir, index, slots);
+  double t;
+  startCounts(b, &t);
+  for (uint32_t n = 0; n < ops; n++) {
+    uint32_t i = nextRandom(b) % b->params->dirFiles;
+    char fileName[10];
+    sd_file f;
+    memset(&f, 0, sizeof(f));
+    dirFileName(i, fileName);
+    if (!sd_open(&b->dir, &f, fileName, O_READ) || f.fileSize_ != b->params->dirFileSize ||
+        sd_read(&f) != fat_image_pattern(FAT_IMAGE_SEED_DIR + i, 0) || !sd_close(&f)) {
+      setDirIndex(&b->dir, NULL, 0);
+      free(index);
+      return false;
+    }
+  }
+  bench_line(b->name, name, ops, bench_now() - t, 0, counts(b));
+  setDirIndex(&b->dir, NULL, 0);
+  free(index);
+  return true;
+}
+
+// open a few files of DIR again and again by path from the root
+static uint8_t benchOpenPath(bench* b) {
+  const uint32_t ops = 500;
+  const uint32_t hot = 4;
+  dentryClear(&b->vol);
+  double t;
+  startCounts(b, &t);
+  for (uint32_t n = 0; n < ops; n++) {
+    uint32_t i = (n % hot) * (b->params->dirFiles / hot);
+    char path[14];
+    sd_file f;
+    memset(&f, 0, sizeof(f));
+    memcpy(path, "DIR/", 4);
+    dirFileName(i, path + 4);
+    if (!sd_open_path(&b->vol, &f, path, O_READ) || f.fileSize_ != b->params->dirFileSize ||
+        sd_read(&f) != fat_image_pattern(FAT_IMAGE_SEED_DIR + i, 0) || !sd_close(&f)) {
+      return false;
+    }
+  }
+  bench_line(b->name, "open-path", ops, bench_now() - t, 0, counts(b));
+
+  // a file created by path is found through the name index of the root
+  sd_dir_slot index[256];
+  sd_file f;
+  memset(&f, 0, sizeof(f));
+  setDirIndex(&b->root, index, 256);
+  uint8_t ok = sd_open(&b->root, &f, "BIG.BIN", O_READ) && sd_close(&f) &&
+               sd_open_path(&b->vol, &f, "PATHNEW.TXT", O_CREAT | O_WRITE) && sd_close(&f) &&
+               sd_open(&b->root, &f, "PATHNEW.TXT", O_READ) && sd_close(&f);
+  setDirIndex(&b->root, NULL, 0);
+  return ok;
+}
+
+// long named files in DIR, more than the short name tails ~1 to ~9 of
+// the basis and of the hashed name
+#define LONG_NAME_FILES 40U
+
+static void longFileName(uint32_t i, char* name) {
+  memcpy(name, "Long asset name 00.bin", 23);
+  name[16] = '0' + (i / 10) % 10;
+  name[17] = '0' + i % 10;
+}
+
+// create files with long names in DIR, then open them by long name
+// through a scan and through a name index of slots entries
+static uint8_t benchLongNames(bench* b, uint32_t slots) {
+  const uint32_t files = LONG_NAME_FILES;
+  const uint32_t ops = 500;
+  uint32_t dirBlock[LONG_NAME_FILES];
+  uint8_t dirIndex[LONG_NAME_FILES];
+  char name[23];
+  sd_file f;
+  for (uint32_t i = 0; i < files; i++) {
+    memset(&f, 0, sizeof(f));
+    longFileName(i, name);
+    if (!sd_open(&b->dir, &f, name, O_CREAT | O_WRITE | O_EXCL)) {
+      return false;
+    }
+    dirBlock[i] = f.dirBlock_;
+    dirIndex[i] = f.dirIndex_;
+    if (!sd_close(&f)) {
+      return false;
+    }
+    // the file exists now, any case of the name finds it
+    memset(&f, 0, sizeof(f));
+    name[0] = 'l';
+    if (sd_open(&b->dir, &f, name, O_CREAT | O_WRITE | O_EXCL)) {
+      return false;
+    }
+  }
+  // the first nine files got the numeric tails, the others hashed names
+  memset(&f, 0, sizeof(f));
+  if (!sd_open(&b->dir, &f, "LONGAS~1.BIN", O_READ) ||
+      f.dirBlock_ != dirBlock[0] || f.dirIndex_ != dirIndex[0] || !sd_close(&f) ||
+      !sd_open(&b->dir, &f, "LONGAS~9.BIN", O_READ) || !sd_close(&f) ||
+      sd_open(&b->dir, &f, "LONGAS~10.BIN", O_READ)) {
+    return false;
+  }
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    sd_dir_slot* index = NULL;
+    if (pass) {
+      index = malloc(slots * sizeof(sd_dir_slot));
+      if (!index) {
+        return false;
+      }
+      setDirIndex(&b->dir, index, slots);
+    }
+    double t;
+    startCounts(b, &t);
+    uint8_t ok = true;
+    for (uint32_t n = 0; n < ops && ok; n++) {
+      uint32_t i = nextRandom(b) % files;
+      memset(&f, 0, sizeof(f));
+      longFileName(i, name);
+      ok = sd_open(&b->dir, &f, name, O_READ) && f.dirBlock_ == dirBlock[i] &&
+           f.dirIndex_ == dirIndex[i] && sd_close(&f);
+    }
+    if (ok) {
+      bench_line(b->name, pass ? "lfn-idx" : "lfn-open", ops, bench_now() - t, 0, counts(b));
+    }
+    setDirIndex(&b->dir, NULL, 0);
+    free(index);
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// read BIG.BIN from start to end, ops are 512 byte blocks
+static uint8_t benchSequential(bench* b) {
+  sd_file f;
+  memset(&f, 0, sizeof(f));
+  if (!sd_open(&b->root, &f, "BIG.BIN", O_READ)) {
+    return false;
+  }
+  double t;
+  startCounts(b, &t);
+  uint32_t pos = 0;
+  int16_t c;
+  while ((c = sd_read(&f)) >= 0) {
+    if (c != fat_image_pattern(FAT_IMAGE_SEED_BIG, pos++)) {
+      return false;
+    }
+  }
+  if (pos != f.fileSize_) {
+    return false;
+  }
+  bench_line(b->name, "seq-read", pos >> 9, bench_now() - t, pos, counts(b));
+  return sd_close(&f);
+}
+
+// read BIG.BIN from start to end with sd_read_buf() in chunks of size
+// bytes, ops are 512 byte blocks
+static uint8_t benchSequentialBuf(bench* b, const char* name, uint32_t size) {
+  sd_file f;
+  memset(&f, 0, sizeof(f));
+  uint8_t* buf = malloc(size);
+  if (!buf || !sd_open(&b->root, &f, "BIG.BIN", O_READ)) {
+    free(buf);
+    return false;
+  }
+  double t;
+  startCounts(b, &t);
+  uint32_t pos = 0;
+  int32_t n;
+  while ((n = sd_read_buf(&f, buf, size)) > 0) {
+    for (int32_t i = 0; i < n; i++) {
+      if (buf[i] != fat_image_pattern(FAT_IMAGE_SEED_BIG, pos + i)) {
+        free(buf);
+        return false;
+      }
+    }
+    pos += n;
+  }
+  free(buf);
+  if (n < 0 || pos != f.fileSize_) {
+    return false;
+  }
+  bench_line(b->name, name, pos >> 9, bench_now() - t, pos, counts(b));
+  return sd_close(&f);
+}
+
+// seek to random positions of BIG.BIN and read 64 bytes, with an
+// extent map of mapSize entries if nonzero
+static uint8_t benchRandom(bench* b, const char* name, uint16_t mapSize) {
+  const uint32_t ops = 2000;
+  const uint32_t span = 64;
+  sd_file f;
+  memset(&f, 0, sizeof(f));
+  if (!sd_open(&b->root, &f, "BIG.BIN", O_READ)) {
+    return false;
+  }
+  sd_extent* map = mapSize ? malloc(mapSize * sizeof(sd_extent)) : NULL;
+  setExtentMap(&f, map, map ? mapSize : 0);
+  double t;
+  startCounts(b, &t);
+  for (uint32_t n = 0; n < ops; n++) {
+    uint32_t pos = nextRandom(b) % (f.fileSize_ - span);
+    if (!seekSet(&f, pos)) {
+      return false;
+    }
+    uint8_t buf[64];
+    if (sd_read_buf(&f, buf, span) != (int32_t)span) {
+      free(map);
+      return false;
+    }
+    for (uint32_t i = 0; i < span; i++) {
+      if (buf[i] != fat_image_pattern(FAT_IMAGE_SEED_BIG, pos + i)) {
+        free(map);
+        return false;
+      }
+    }
+  }
+  free(map);
+  bench_line(b->name, name, ops, bench_now() - t, (uint64_t)ops * span, counts(b));
+  return sd_close(&f);
+}
+
+// walk every entry of DIR, ops are directory entries
+static uint8_t benchScan(bench* b) {
+  const uint32_t passes = 20;
+  uint32_t entries = 0;
+  double t;
+  startCounts(b, &t);
+  for (uint32_t n = 0; n < passes; n++) {
+    uint32_t files = 0;
+    rewind(&b->dir);
+    while (b->dir.curPosition_ < b->dir.fileSize_) {
+      dir_t* p = readDirCache(&b->dir);
+      if (!p) {
+        if (b->dir.curPosition_ == b->dir.fileSize_) {
+          break;
+        }
+        return false;
+      }
+      if (p->name[0] == DIR_NAME_FREE) {
+        break;
+      }
+      entries++;
+      if (p->name[0] != DIR_NAME_DELETED && DIR_IS_FILE(p)) {
+        files++;
+      }
+    }
+    if (files != b->params->dirFiles + LONG_NAME_FILES) {
+      return false;
+    }
+  }
+  bench_line(b->name, "dir-scan", entries, bench_now() - t, (uint64_t)entries * 32, counts(b));
+  return true;
+}
+
+// list DIR a block at a time with sd_readdir(), ops are directory entries
+static uint8_t benchList(bench* b) {
+  const uint32_t passes = 20;
+  uint32_t entries = 0;
+  double t;
+  startCounts(b, &t);
+  for (uint32_t pass = 0; pass < passes; pass++) {
+    uint32_t files = 0;
+    int8_t n;
+    rewind(&b->dir);
+    do {
+      dir_t* p;
+      uint16_t valid;
+      n = sd_readdir(&b->dir, &p, &valid, READDIR_SKIP_DELETED | READDIR_SKIP_LONG_NAME);
+      if (n < 0) {
+        return false;
+      }
+      entries += n;
+      for (uint8_t i = 0; valid; i++, valid >>= 1) {
+        if ((valid & 1) && DIR_IS_FILE(p + i)) {
+          files++;
+        }
+      }
+    } while (n == 16);
+    if (files != b->params->dirFiles + LONG_NAME_FILES) {
+      return false;
+    }
+  }
+  bench_line(b->name, "dir-list", entries, bench_now() - t, (uint64_t)entries * 32, counts(b));
+  return true;
+}
+
+// grow ALLOC.BIN cluster by cluster then free the chain again, ops are
+// clusters
+static uint8_t benchAlloc(bench* b, const char* name, uint32_t ops, uint32_t clusters) {
+  sd_file f;
+  memset(&f, 0, sizeof(f));
+  if (!sd_open(&b->root, &f, "ALLOC.BIN", O_RDWR)) {
+    return false;
+  }
+  double t;
+  startCounts(b, &t);
+  for (uint32_t n = 0; n < ops; n++) {
+    for (uint32_t i = 0; i < clusters; i++) {
+      if (!addCluster(&f)) {
+        return false;
+      }
+    }
+    if (!truncate(&f, 0) || f.firstCluster_ != 0) {
+      return false;
+    }
+  }
+  if (!sd_close(&f) || !cacheFlush(&b->vol, true)) {
+    return false;
+  }
+  bench_line(b->name, name, ops * clusters, bench_now() - t, 0, counts(b));
+  return true;
+}
+
+// write size bytes to WRITE.BIN chunk bytes at a time, read them back
+// and check the chain and directory entry, then free the clusters
+static uint8_t benchWrite(bench* b, const char* name, uint32_t size, uint32_t chunk, uint8_t oflag,
+                          uint8_t nonBlocking) {
+  const uint32_t seed = 3;
+  uint32_t clusterBytes = 512UL << b->vol.clusterSizeShift_;
+  uint32_t freeBefore;
+  uint32_t freeAfter;
+  uint32_t chain;
+  sd_file f;
+  memset(&f, 0, sizeof(f));
+  uint8_t* buf = malloc(chunk);
+  // the create may grow the root directory, count free clusters after it
+  if (!buf || !sd_open(&b->root, &f, "WRITE.BIN", O_CREAT | O_TRUNC | O_RDWR | oflag) ||
+      !freeClusterCount(&b->vol, &freeBefore)) {
+    free(buf);
+    return false;
+  }
+  setNonBlockingWrite(&f, nonBlocking);
+  b->count.dataStart_ = b->vol.dataStartBlock_;
+  b->count.nonBlockingRuns_ = 0;
+  double t;
+  startCounts(b, &t);
+  for (uint32_t pos = 0; pos < size; pos += chunk) {
+    uint32_t n = size - pos < chunk ? size - pos : chunk;
+    for (uint32_t i = 0; i < n; i++) {
+      buf[i] = fat_image_pattern(seed, pos + i);
+    }
+    if (sd_write(&f, buf, n) != (int32_t)n) {
+      free(buf);
+      return false;
+    }
+    // appends start at the end of file wherever the position is
+    if ((oflag & O_APPEND) && !seekSet(&f, 0)) {
+      free(buf);
+      return false;
+    }
+  }
+  // whole block runs must reach the device with the flag as set
+  uint8_t runsOk = (b->count.nonBlockingRuns_ != 0) == (nonBlocking && chunk >= 1024);
+  if (!sd_close(&f) || !cacheFlush(&b->vol, true) || !runsOk) {
+    free(buf);
+    return false;
+  }
+  bench_line(b->name, name, size >> 9, bench_now() - t, size, counts(b));
+
+  // reopen to read the size from the directory entry
+  uint8_t ok = sd_open(&b->root, &f, "WRITE.BIN", O_RDWR) && f.fileSize_ == size &&
+               chainSize(&b->vol, f.firstCluster_, &chain) &&
+               chain == (size + clusterBytes - 1) / clusterBytes * clusterBytes;
+  int32_t n = 0;
+  for (uint32_t pos = 0; ok && pos < size; pos += n) {
+    n = sd_read_buf(&f, buf, chunk);
+    ok = n > 0;
+    for (int32_t i = 0; ok && i < n; i++) {
+      ok = buf[i] == fat_image_pattern(seed, pos + i);
+    }
+  }
+  free(buf);
+  return ok && truncate(&f, 0) && sd_close(&f) &&
+         freeClusterCount(&b->vol, &freeAfter) && freeAfter == freeBefore;
+}
+
+// allocation with the free cluster bitmap, then check the bitmap against
+// the FAT
+static uint8_t benchBitmapAlloc(bench* b) {
+  uint32_t words = fatBitmapWords(&b->vol);
+  uint32_t* bitmap = malloc(words * sizeof(uint32_t));
+  uint8_t ok = bitmap && fatBitmapInit(&b->vol, bitmap, words) && benchAlloc(b, "alloc-bmp", 50, 16);
+  for (uint32_t c = 2; ok && c <= b->vol.clusterCount_ + 1; c++) {
+    uint32_t region = c >> (b->vol.fatType_ == 16 ? 8 : 7);
+    uint32_t f;
+    if (!((b->vol.bitmapLoaded_[region >> 5] >> (region & 31)) & 1)) {
+      continue;
+    }
+    ok = fatGet(&b->vol, c, &f) && ((b->vol.bitmap_[c >> 5] >> (c & 31)) & 1) == (f != 0);
+  }
+  fatBitmapInit(&b->vol, NULL, 0);
+  free(bitmap);
+  return ok;
+}
+
+// mount and free space query, checked against a FAT walk
+static uint8_t benchFree(bench* b) {
+  sd_volume vol;
+  block_dev dev = {&countOps, &b->count};
+  uint32_t count;
+  if (!cacheFlush(&b->vol, true)) {
+    return false;
+  }
+  double t;
+  startCounts(b, &t);
+  if (!sd_volume_init(&vol, &dev) || !freeClusterCount(&vol, &count)) {
+    return false;
+  }
+  t = bench_now() - t;
+  bench_counts c = b->count.counts_;
+  c.cacheHits_ = c.cacheMisses_ = c.fatCacheHits_ = c.fatCacheMisses_ = 0;
+  bench_line(b->name, "mount+free", 1, t, 0, &c);
+
+  uint32_t expected = 0;
+  for (uint32_t n = 2; n <= vol.clusterCount_ + 1; n++) {
+    uint32_t f;
+    if (!fatGet(&vol, n, &f)) {
+      return false;
+    }
+    expected += f == 0;
+  }
+  if (count != expected) {
+    return false;
+  }
+  // the second FAT must match the first
+  for (uint32_t i = 0; vol.fatCopies_ > 1 && i < vol.blocksPerFat_; i++) {
+    uint8_t fat0[512];
+    uint8_t fat1[512];
+    if (!devReadBlock(&vol, vol.fatStartBlock_ + i, fat0) ||
+        !devReadBlock(&vol, vol.fatStartBlock_ + vol.blocksPerFat_ + i, fat1) ||
+        memcmp(fat0, fat1, 512)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// run every bench on a generated image, from the image file or with
+// the image loaded into a ram_disk if inRam
+static uint8_t runImage(const char* dirPath, const char* name, const fat_image_params* params,
+                        uint8_t inRam) {
+  char path[512];
+  bench_path(path, sizeof(path), dirPath, name);
+  if (!fat_image_create(path, params)) {
+    bench_error(name, "image create");
+    return false;
+  }
+  file_disk disk;
+  block_dev base;
+  block_dev dev;
+  bench b;
+  memset(&b, 0, sizeof(b));
+  b.name = name;
+  b.params = params;
+  b.seed = 1;
+  if (!file_disk_open(&disk, &base, path, true)) {
+    bench_error(name, "open");
+    return false;
+  }
+  b.count.base_ = &base;
+  ram_disk ram;
+  block_dev ramDev;
+  uint8_t* data = NULL;
+  if (inRam) {
+    uint32_t blocks = base.ops_->sectorCount(base.ctx_);
+    data = malloc((size_t)blocks << 9);
+    if (!data || !base.ops_->readBlocks(base.ctx_, 0, blocks, data)) {
+      bench_error(name, "load");
+      free(data);
+      file_disk_close(&disk);
+      bench_remove(path);
+      return false;
+    }
+    ram_disk_init(&ram, &ramDev, data, blocks);
+    b.count.base_ = &ramDev;
+  }
+  dev.ops_ = &countOps;
+  dev.ctx_ = &b.count;
+
+  uint8_t ok = false;
+  if (!sd_volume_init(&b.vol, &dev) || b.vol.fatType_ != params->fatType) {
+    bench_error(name, "mount");
+  } else if (!openRoot(&b.root, &b.vol) || !sd_open(&b.root, &b.dir, "DIR", O_READ)) {
+    bench_error(name, "open DIR");
+  } else if (!benchOpen(&b, "open", 0)) {
+    bench_error(name, "open");
+  } else if (!benchOpen(&b, "open-idx", 2 * params->dirFiles)) {
+    bench_error(name, "open with name index");
+  } else if (!benchOpenPath(&b)) {
+    bench_error(name, "open by path");
+  } else if (!benchLongNames(&b, 2 * params->dirFiles + 8 * LONG_NAME_FILES)) {
+    bench_error(name, "long names");
+  } else if (!benchSequential(&b)) {
+    bench_error(name, "sequential read");
+  } else if (!benchSequentialBuf(&b, "seq-1000", 1000)) {
+    bench_error(name, "sequential buffer read");
+  } else if (!benchSequentialBuf(&b, "seq-16k", 16384)) {
+    bench_error(name, "sequential buffer read");
+  } else if (!benchRandom(&b, "rand-read", 0)) {
+    bench_error(name, "random read");
+  } else if (!benchRandom(&b, "rand-map", 1024)) {
+    bench_error(name, "random read with extent map");
+  } else if (!benchScan(&b)) {
+    bench_error(name, "directory scan");
+  } else if (!benchList(&b)) {
+    bench_error(name, "directory list");
+  } else if (!benchWrite(&b, "write-seq", 2UL << 20, 16384, 0, false)) {
+    bench_error(name, "sequential write");
+  } else if (!benchWrite(&b, "write-nb", 2UL << 20, 16384, 0, true)) {
+    bench_error(name, "non-blocking sequential write");
+  } else if (!benchWrite(&b, "write-1000", 256UL << 10, 1000, 0, false)) {
+    bench_error(name, "buffered write");
+  } else if (!benchWrite(&b, "write-app", 64UL << 10, 100, O_APPEND | O_SYNC, true)) {
+    bench_error(name, "append write");
+  } else if (!benchAlloc(&b, "alloc", 50, 16)) {
+    bench_error(name, "allocation");
+  } else if (!benchAlloc(&b, "alloc-big", 4, 4096)) {
+    bench_error(name, "large allocation");
+  } else if (!benchBitmapAlloc(&b)) {
+    bench_error(name, "bitmap allocation");
+  } else if (!benchFree(&b)) {
+    bench_error(name, "free space");
+  } else {
+    ok = true;
+  }
+  free(data);
+  file_disk_close(&disk);
+  bench_remove(path);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  // fatType, totalSectors, sectorsPerCluster, dirFiles, dirFileSize, bigFileSize, fragRun
+  static const fat_image_params fat16Contig = {16, 65536, 4, 400, 1000, 4UL << 20, 0};
+  static const fat_image_params fat16Frag = {16, 65536, 4, 400, 1000, 4UL << 20, 1};
+  static const fat_image_params fat32Contig = {32, 131072, 1, 1000, 700, 8UL << 20, 0};
+  static const fat_image_params fat32Frag = {32, 131072, 1, 1000, 700, 8UL << 20, 1};
+  static const fat_image_params fat32Large = {32, 524288, 4, 2000, 3000, 16UL << 20, 8};
+  const char* dirPath = argc > 1 ? argv[1] : ".";
+  uint8_t ok = true;
+
+  bench_header();
+  ok &= runImage(dirPath, "fat16-32M", &fat16Contig, false);
+  ok &= runImage(dirPath, "fat16-32M-frag", &fat16Frag, false);
+  ok &= runImage(dirPath, "fat32-64M", &fat32Contig, false);
+  ok &= runImage(dirPath, "fat32-64M-frag", &fat32Frag, false);
+  ok &= runImage(dirPath, "fat32-256M-frag8", &fat32Large, false);
+  // the same images on the ram_disk backend
+  ok &= runImage(dirPath, "fat16-32M-ram", &fat16Contig, true);
+  ok &= runImage(dirPath, "fat32-64M-ram", &fat32Contig, true);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sd_volume.h"
+#include "fat_image.h"
+
+// image being built
+typedef struct {
+  FILE* f;
+  const fat_image_params* p;
+  uint32_t reserved;
+  uint32_t fatSectors;
+  uint32_t rootSectors;
+  uint32_t dataStart;
+  uint32_t clusterCount;
+  uint32_t clusterBytes;
+  // next entry of each cluster, indexed by cluster number
+  uint32_t* fat;
+  uint32_t nextFree;
+} image;
+
+static uint8_t writeAt(image* img, uint64_t pos, const void* buf, size_t n) {
+  return fseeko(img->f, (off_t)pos, SEEK_SET) == 0 && fwrite(buf, 1, n, img->f) == n;
+}
+
+static uint32_t eoc(image* img) {
+  return img->p->fatType == 16 ? FAT16EOC : FAT32EOC;
+}
+
+// allocate count clusters as one contiguous chain and return the first
+static uint32_t allocRun(image* img, uint32_t count, uint32_t* last) {
+  uint32_t first = img->nextFree;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t c = first + i;
+    img->fat[c] = i + 1 < count ? c + 1 : eoc(img);
+  }
+  img->nextFree += count;
+  if (last) {
+    *last = first + count - 1;
+  }
+  return first;
+}
+
+static uint32_t clustersFor(image* img, uint32_t bytes) {
+  return (bytes + img->clusterBytes - 1) / img->clusterBytes;
+}
+
+static uint64_t clusterPos(image* img, uint32_t cluster) {
+  return ((uint64_t)img->dataStart + (uint64_t)(cluster - 2) * img->p->sectorsPerCluster) << 9;
+}
+
+// write size bytes of the pattern for seed along the chain from first
+static uint8_t writeChain(image* img, uint32_t first, uint32_t size, uint32_t seed) {
+  uint8_t* buf = malloc(img->clusterBytes);
+  uint32_t pos = 0;
+  uint8_t ok = buf != NULL;
+  for (uint32_t c = first; ok && pos < size; c = img->fat[c]) {
+    for (uint32_t i = 0; i < img->clusterBytes; i++) {
+      buf[i] = pos + i < size ? fat_image_pattern(seed, pos + i) : 0;
+    }
+    ok = writeAt(img, clusterPos(img, c), buf, img->clusterBytes);
+    pos += img->clusterBytes;
+  }
+  free(buf);
+  return ok;
+}
+
+static void setEntry(dir_t* d, const char* name83, uint8_t attributes, uint32_t cluster, uint32_t size) {
+  memset(d, 0, sizeof(dir_t));
+  memcpy(d->name, name83, 11);
+  d->attributes = attributes;
+  d->firstClusterHigh = cluster >> 16;
+  d->firstClusterLow = cluster & 0XFFFF;
+  d->fileSize = size;
+}
+
+// compute FAT size and cluster count for the requested geometry
+static uint8_t layout(image* img) {
+  const fat_image_params* p = img->p;
+  img->reserved = p->fatType == 32 ? 32 : 4;
+  img->rootSectors = p->fatType == 32 ? 0 : 32;
+  img->clusterBytes = 512UL * p->sectorsPerCluster;
+  img->fatSectors = 1;
+  for (;;) {
+    uint32_t data = p->totalSectors - img->reserved - 2 * img->fatSectors - img->rootSectors;
+    uint32_t clusters = data / p->sectorsPerCluster;
+    uint32_t need = ((clusters + 2) * (p->fatType / 8) + 511) / 512;
+    if (need <= img->fatSectors) {
+      img->clusterCount = clusters;
+      break;
+    }
+    img->fatSectors = need;
+  }
+  img->dataStart = img->reserved + 2 * img->fatSectors + img->rootSectors;
+  // the type must match the one sd_volume derives from the cluster count
+  if (p->fatType == 16) {
+    return img->clusterCount >= 4085 && img->clusterCount < 65525;
+  }
+  return img->clusterCount >= 65525;
+}
+
+static uint8_t writeBootSectors(image* img, uint32_t freeCount) {
+  const fat_image_params* p = img->p;
+  uint8_t sector[512];
+  memset(sector, 0, 512);
+  fbs_t* fbs = (fbs_t*)sector;
+  fbs->jmpToBootCode[0] = 0XEB;
+  fbs->jmpToBootCode[1] = 0X58;
+  fbs->jmpToBootCode[2] = 0X90;
+  memcpy(fbs->oemName, "RASPHOST", 8);
+  fbs->bpb.bytesPerSector = 512;
+  fbs->bpb.sectorsPerCluster = p->sectorsPerCluster;
+  fbs->bpb.reservedSectorCount = img->reserved;
+  fbs->bpb.fatCount = 2;
+  fbs->bpb.rootDirEntryCount = img->rootSectors * 16;
+  fbs->bpb.mediaType = 0XF8;
+  if (p->totalSectors < 0X10000 && p->fatType == 16) {
+    fbs->bpb.totalSectors16 = p->totalSectors;
+  } else {
+    fbs->bpb.totalSectors32 = p->totalSectors;
+  }
+  if (p->fatType == 16) {
+    fbs->bpb.sectorsPerFat16 = img->fatSectors;
+    // FAT16 extended boot record follows the common BPB at offset 36
+    sector[36] = 0X80;
+    sector[38] = 0X29;
+    memcpy(sector + 43, "NO NAME    ", 11);
+    memcpy(sector + 54, "FAT16   ", 8);
+  } else {
+    fbs->bpb.sectorsPerFat32 = img->fatSectors;
+    fbs->bpb.fat32RootCluster = 2;
+    fbs->bpb.fat32FSInfo = 1;
+    fbs->bpb.fat32BackBootBlock = 6;
+    fbs->driveNumber = 0X80;
+    fbs->bootSignature = 0X29;
+    memcpy(fbs->volumeLabel, "NO NAME    ", 11);
+    memcpy(fbs->fileSystemType, "FAT32   ", 8);
+  }
+  fbs->bootSectorSig0 = 0X55;
+  fbs->bootSectorSig1 = 0XAA;
+  if (!writeAt(img, 0, sector, 512)) {
+    return false;
+  }
+  if (p->fatType == 16) {
+    return true;
+  }
+  if (!writeAt(img, 6 * 512, sector, 512)) {
+    return false;
+  }
+  // FSInfo and its backup
+  memset(sector, 0, 512);
+  uint32_t* w = (uint32_t*)sector;
+  w[0] = 0X41615252;
+  w[121] = 0X61417272;
+  w[122] = freeCount;
+  w[123] = img->nextFree;
+  w[127] = 0XAA550000;
+  return writeAt(img, 512, sector, 512) && writeAt(img, 7 * 512, sector, 512);
+}
+
+static uint8_t writeFats(image* img) {
+  uint32_t entries = img->clusterCount + 2;
+  uint32_t bytes = img->fatSectors * 512;
+  uint8_t* buf = calloc(1, bytes);
+  if (!buf) {
+    return false;
+  }
+  img->fat[0] = img->p->fatType == 16 ? 0XFFF8 : 0X0FFFFFF8;
+  img->fat[1] = eoc(img);
+  for (uint32_t i = 0; i < entries; i++) {
+    if (img->p->fatType == 16) {
+      ((uint16_t*)buf)[i] = img->fat[i];
+    } else {
+      ((uint32_t*)buf)[i] = img->fat[i];
+    }
+  }
+  uint8_t ok = writeAt(img, (uint64_t)img->reserved << 9, buf, bytes) &&
+               writeAt(img, (uint64_t)(img->reserved + img->fatSectors) << 9, buf, bytes);
+  free(buf);
+  return ok;
+}
+
+// Create a FAT16 or FAT32 image at path. The file is sparse, only
+// metadata and file contents are written.
+uint8_t fat_image_create(const char* path, const fat_image_params* params) {
+  image img;
+  memset(&img, 0, sizeof(img));
+  img.p = params;
+  if (!layout(&img)) {
+    return false;
+  }
+  img.f = fopen(path, "w+b");
+  if (!img.f) {
+    return false;
+  }
+  img.fat = calloc(img.clusterCount + 2, sizeof(uint32_t));
+  uint8_t ok = img.fat != NULL;
+  img.nextFree = 2;
+
+  // allocate clusters in the order a freshly written card would have them
+  uint32_t rootCluster = 0;
+  if (params->fatType == 32) {
+    rootCluster = allocRun(&img, 1, NULL);
+  }
+  uint32_t dirBytes = (params->dirFiles + 2) * 32;
+  uint32_t dirClusters = clustersFor(&img, dirBytes);
+  uint32_t dirCluster = allocRun(&img, dirClusters, NULL);
+  uint32_t* fileClusters = calloc(params->dirFiles + 1, sizeof(uint32_t));
+  ok = ok && fileClusters != NULL;
+  for (uint32_t i = 0; ok && i < params->dirFiles; i++) {
+    uint32_t n = clustersFor(&img, params->dirFileSize);
+    fileClusters[i] = n ? allocRun(&img, n, NULL) : 0;
+  }
+  uint32_t bigClusters = clustersFor(&img, params->bigFileSize);
+  uint32_t bigFirst = 0, bigLast = 0, fillFirst = 0, fillLast = 0, fillClusters = 0;
+  if (params->fragRun == 0) {
+    bigFirst = bigClusters ? allocRun(&img, bigClusters, &bigLast) : 0;
+  } else {
+    // alternate runs of BIG.BIN and FILL.BIN
+    for (uint32_t done = 0; ok && done < bigClusters; ) {
+      uint32_t n = bigClusters - done < params->fragRun ? bigClusters - done : params->fragRun;
+      uint32_t last;
+      uint32_t first = allocRun(&img, n, &last);
+      if (bigFirst) {
+        img.fat[bigLast] = first;
+      } else {
+        bigFirst = first;
+      }
+      bigLast = last;
+      done += n;
+      first = allocRun(&img, params->fragRun, &last);
+      if (fillFirst) {
+        img.fat[fillLast] = first;
+      } else {
+        fillFirst = first;
+      }
+      fillLast = last;
+      fillClusters += params->fragRun;
+    }
+  }
+  if (img.nextFree > img.clusterCount + 1) {
+    ok = false;
+  }
+
+  // directory contents
+  uint32_t rootBytes = params->fatType == 32 ? img.clusterBytes : img.rootSectors * 512;
+  uint8_t* root = calloc(1, rootBytes);
+  uint8_t* dir = calloc(1, dirClusters * img.clusterBytes);
+  ok = ok && root && dir;
+  if (ok) {
+    dir_t* r = (dir_t*)root;
+    setEntry(r++, "DIR        ", DIR_ATT_DIRECTORY, dirCluster, 0);
+    setEntry(r++, "BIG     BIN", DIR_ATT_ARCHIVE, bigFirst, params->bigFileSize);
+    if (fillFirst) {
+      setEntry(r++, "FILL    BIN", DIR_ATT_ARCHIVE, fillFirst, fillClusters * img.clusterBytes);
+    }
+    setEntry(r++, "ALLOC   BIN", DIR_ATT_ARCHIVE, 0, 0);
+
+    dir_t* d = (dir_t*)dir;
+    setEntry(d++, ".          ", DIR_ATT_DIRECTORY, dirCluster, 0);
+    setEntry(d++, "..         ", DIR_ATT_DIRECTORY, 0, 0);
+    for (uint32_t i = 0; i < params->dirFiles; i++) {
+      char name[12];
+      memcpy(name, "F0000   BIN", 12);
+      name[1] = '0' + (i / 1000) % 10;
+      name[2] = '0' + (i / 100) % 10;
+      name[3] = '0' + (i / 10) % 10;
+      name[4] = '0' + i % 10;
+      setEntry(d++, name, DIR_ATT_ARCHIVE, fileClusters[i], params->dirFileSize);
+    }
+  }
+
+  // size the sparse image then write everything
+  uint8_t zero = 0;
+  ok = ok && writeAt(&img, ((uint64_t)params->totalSectors << 9) - 1, &zero, 1);
+  if (ok && params->fatType == 32) {
+    ok = writeAt(&img, clusterPos(&img, rootCluster), root, rootBytes);
+  } else if (ok) {
+    ok = writeAt(&img, (uint64_t)(img.reserved + 2 * img.fatSectors) << 9, root, rootBytes);
+  }
+  for (uint32_t i = 0, c = dirCluster; ok && i < dirClusters; i++, c = img.fat[c]) {
+    ok = writeAt(&img, clusterPos(&img, c), dir + i * img.clusterBytes, img.clusterBytes);
+  }
+  for (uint32_t i = 0; ok && i < params->dirFiles; i++) {
+    ok = writeChain(&img, fileClusters[i], params->dirFileSize, FAT_IMAGE_SEED_DIR + i);
+  }
+  ok = ok && writeChain(&img, bigFirst, params->bigFileSize, FAT_IMAGE_SEED_BIG);
+  if (fillFirst) {
+    ok = ok && writeChain(&img, fillFirst, fillClusters * img.clusterBytes, FAT_IMAGE_SEED_FILL);
+  }
+  ok = ok && writeFats(&img);
+  ok = ok && writeBootSectors(&img, img.clusterCount + 2 - img.nextFree);
+
+  free(root);
+  free(dir);
+  free(fileClusters);
+  free(img.fat);
+  if (fclose(img.f) != 0) {
+    ok = false;
+  }
+  return ok;
+}
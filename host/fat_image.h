@@ -0,0 +1,45 @@
+#ifndef __FAT_IMAGE_H
+#define __FAT_IMAGE_H
+
+#include <stdint.h>
+
+/**
+   Layout of a generated FAT image. The image has no MBR and holds
+
+   - DIR        subdirectory with dirFiles files F0000.BIN, F0001.BIN, ...
+   - BIG.BIN    bigFileSize bytes
+   - FILL.BIN   clusters interleaved with BIG.BIN when fragRun is nonzero
+   - ALLOC.BIN  empty file used by allocation benchmarks
+*/
+typedef struct __FAT_IMAGE_PARAMS_PROT
+{
+  /** 16 or 32 */
+  uint8_t fatType;
+  uint32_t totalSectors;
+  uint8_t sectorsPerCluster;
+  uint16_t dirFiles;
+  uint32_t dirFileSize;
+  uint32_t bigFileSize;
+  /** clusters per run of BIG.BIN between runs of FILL.BIN, zero for a
+      contiguous BIG.BIN */
+  uint32_t fragRun;
+} fat_image_params;
+
+// content seeds of the generated files
+#define FAT_IMAGE_SEED_BIG 1
+#define FAT_IMAGE_SEED_FILL 2
+#define FAT_IMAGE_SEED_DIR 100
+
+/** byte at pos of a generated file */
+static inline uint8_t fat_image_pattern(uint32_t seed, uint32_t pos) {
+  return (uint8_t)(pos * 31 + seed + (pos >> 9));
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+uint8_t fat_image_create(const char* path, const fat_image_params* params);
+#ifdef __cplusplus
+}
+#endif
+#endif
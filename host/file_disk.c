@@ -0,0 +1,83 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "file_disk.h"
+
+static uint8_t fileRead(file_disk* disk, off_t pos, size_t n, uint8_t* dst) {
+  return pread(disk->fd_, dst, n, pos) == (ssize_t)n;
+}
+
+static uint8_t fileReadData(void* ctx, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+  file_disk* disk = (file_disk*)ctx;
+  if (block >= disk->blockCount_ || (count + offset) > 512) {
+    return false;
+  }
+  return fileRead(disk, ((off_t)block << 9) + offset, count, dst);
+}
+
+static uint8_t fileReadBlocks(void* ctx, uint32_t block, uint32_t count, uint8_t* dst) {
+  file_disk* disk = (file_disk*)ctx;
+  if (block >= disk->blockCount_ || count > disk->blockCount_ - block) {
+    return false;
+  }
+  return fileRead(disk, (off_t)block << 9, (size_t)count << 9, dst);
+}
+
+static uint8_t fileReadBlock(void* ctx, uint32_t block, uint8_t* dst) {
+  return fileReadBlocks(ctx, block, 1, dst);
+}
+
+static uint8_t fileWriteBlocks(void* ctx, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+  file_disk* disk = (file_disk*)ctx;
+  if (block >= disk->blockCount_ || count > disk->blockCount_ - block) {
+    return false;
+  }
+  (void)blocking;
+  size_t n = (size_t)count << 9;
+  return pwrite(disk->fd_, src, n, (off_t)block << 9) == (ssize_t)n;
+}
+
+static uint8_t fileWriteBlock(void* ctx, uint32_t block, const uint8_t* src, uint8_t blocking) {
+  return fileWriteBlocks(ctx, block, 1, src, blocking);
+}
+
+static uint8_t fileSync(void* ctx) {
+  return fsync(((file_disk*)ctx)->fd_) == 0;
+}
+
+static uint32_t fileSectorCount(void* ctx) {
+  return ((file_disk*)ctx)->blockCount_;
+}
+
+static const block_dev_ops fileDiskOps = {
+  fileReadData,
+  fileReadBlock,
+  fileWriteBlock,
+  fileReadBlocks,
+  fileWriteBlocks,
+  fileSync,
+  fileSectorCount
+};
+
+// Open a FAT16/FAT32 image file as a block device.
+uint8_t file_disk_open(file_disk* disk, block_dev* dev, const char* path, uint8_t writable) {
+  struct stat st;
+  disk->fd_ = open(path, writable ? O_RDWR : O_RDONLY);
+  if (disk->fd_ < 0) {
+    return false;
+  }
+  if (fstat(disk->fd_, &st) != 0) {
+    close(disk->fd_);
+    return false;
+  }
+  disk->blockCount_ = st.st_size >> 9;
+  dev->ops_ = &fileDiskOps;
+  dev->ctx_ = disk;
+  return true;
+}
+
+void file_disk_close(file_disk* disk) {
+  close(disk->fd_);
+  disk->fd_ = -1;
+}
@@ -0,0 +1,21 @@
+#ifndef __FILE_DISK_H
+#define __FILE_DISK_H
+
+#include "block_dev.h"
+
+/** Block device backed by a disk image file on the host */
+typedef struct __FILE_DISK_PROT
+{
+  int fd_;
+  uint32_t blockCount_;
+} file_disk;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+uint8_t file_disk_open(file_disk* disk, block_dev* dev, const char* path, uint8_t writable);
+void file_disk_close(file_disk* disk);
+#ifdef __cplusplus
+}
+#endif
+#endif
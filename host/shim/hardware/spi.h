@@ -0,0 +1,8 @@
+#ifndef __HOST_SHIM_HARDWARE_SPI_H
+#define __HOST_SHIM_HARDWARE_SPI_H
+
+#include <pico/stdlib.h>
+
+typedef struct spi_inst spi_inst_t;
+
+#endif
@@ -0,0 +1,3 @@
+#ifndef __HOST_SHIM_PICO_BINARY_INFO_H
+#define __HOST_SHIM_PICO_BINARY_INFO_H
+#endif
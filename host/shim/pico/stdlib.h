@@ -0,0 +1,14 @@
+#ifndef __HOST_SHIM_PICO_STDLIB_H
+#define __HOST_SHIM_PICO_STDLIB_H
+
+// Just enough of the pico-sdk for the FAT layer to build on the host.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+#endif
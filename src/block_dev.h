@@ -0,0 +1,34 @@
+#ifndef __BLOCK_DEV_H
+#define __BLOCK_DEV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+   Operations of a 512 byte block device. Every function gets the ctx_
+   pointer of the device and returns nonzero on success.
+*/
+typedef struct __BLOCK_DEV_OPS_PROT
+{
+  /** read count bytes at offset of a block */
+  uint8_t (*readData)(void* ctx, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst);
+  uint8_t (*readBlock)(void* ctx, uint32_t block, uint8_t* dst);
+  /** blocking zero may return before the block is programmed */
+  uint8_t (*writeBlock)(void* ctx, uint32_t block, const uint8_t* src, uint8_t blocking);
+  uint8_t (*readBlocks)(void* ctx, uint32_t block, uint32_t count, uint8_t* dst);
+  /** blocking zero may return before the last block is programmed */
+  uint8_t (*writeBlocks)(void* ctx, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking);
+  /** wait until all written data is stored */
+  uint8_t (*sync)(void* ctx);
+  /** device size in blocks, zero if unknown */
+  uint32_t (*sectorCount)(void* ctx);
+} block_dev_ops;
+
+/** A block device a volume is mounted on */
+typedef struct __BLOCK_DEV_PROT
+{
+  const block_dev_ops* ops_;
+  void* ctx_;
+} block_dev;
+
+#endif
@@ -6,37 +6,104 @@
 #include "graphics.h"
 #include "sd_volume.h"
 #include "sd_file.h"
-// #include "sd_driver.h"
+#include "sd_driver.h"
+#include "sd_stripe.h"
 
 // static const uint I2C_MASTER_SDA_PIN = 6;
 // static const uint I2C_MASTER_SCL_PIN = 7;
 
 // static uint8_t gray_image[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x40, 0xe0, 0x10, 0xf0, 0xa8, 0x58, 0xe8, 0x54, 0xbc, 0x64, 0xdc, 0xb4, 0xe8, 0xbc, 0x48, 0xf8, 0xd0, 0xb0, 0x60, 0xc0, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x94, 0x29, 0x56, 0x89, 0xb6, 0x03, 0x00, 0xd9, 0x24, 0x54, 0x0c, 0x44, 0xcc, 0x24, 0xc4, 0x1c, 0x14, 0xe0, 0xb9, 0x00, 0x07, 0xfd, 0x5b, 0xa6, 0xff, 0x54, 0xb0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x41, 0x14, 0x42, 0x14, 0x40, 0x80, 0x0a, 0x25, 0x18, 0x20, 0x13, 0x12, 0x21, 0x2a, 0x10, 0x2c, 0x17, 0x94, 0x80, 0x60, 0x9f, 0xf5, 0x2a, 0xd7, 0x3d, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x0a, 0x00, 0x04, 0x11, 0x04, 0x09, 0x22, 0x15, 0x00, 0x17, 0x08, 0x13, 0x05, 0x2a, 0x05, 0x0a, 0x03, 0x04, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
 
+static sd_card card;
+static block_dev device;
 static sd_volume volume;
 static sd_file rootdir;
 
+#if defined(SD_BENCHMARK) || defined(SD_STRIPE_BENCHMARK)
+// number of blocks read per benchmark pass
+#define BENCH_BLOCKS 2048
+// blocks per readBlocks() call
+#define BENCH_RUN 8
+
+static uint8_t benchBuffer[BENCH_RUN * 512];
+// read throughput in bytes per second, inspect with the debugger
+static volatile uint32_t benchCrcOn;
+static volatile uint32_t benchCrcOff;
+static volatile uint32_t benchSingle;
+static volatile uint32_t benchStriped;
+
+static uint32_t benchRate(uint64_t t0) {
+    uint64_t us = time_us_64() - t0;
+    return (uint32_t)((512ULL * BENCH_BLOCKS * 1000000) / (us ? us : 1));
+}
+
+// bytes per second reading BENCH_BLOCKS blocks from block in runs
+static uint32_t benchReadBlocks(sd_card* pcard, uint32_t block) {
+    uint64_t t0 = time_us_64();
+    for (uint32_t i = 0; i < BENCH_BLOCKS; i += BENCH_RUN) {
+        if (!readBlocks(pcard, block + i, BENCH_RUN, benchBuffer)) {
+            return 0;
+        }
+    }
+    return benchRate(t0);
+}
+
+// bytes per second reading BENCH_BLOCKS logical blocks from a stripe set
+static uint32_t benchStripeReadBlocks(sd_stripe* stripe, uint32_t block) {
+    uint64_t t0 = time_us_64();
+    for (uint32_t i = 0; i < BENCH_BLOCKS; i += BENCH_RUN) {
+        if (!stripeReadBlocks(stripe, block + i, BENCH_RUN, benchBuffer)) {
+            return 0;
+        }
+    }
+    return benchRate(t0);
+}
+#endif
+
 int main() {
 
     sd_file file = {0};
     
-    uint8_t volresult = sd_volume_init(&volume);
+    sd_card_config(&card, spi0, PIN_MISO, PIN_CS, PIN_SCK, PIN_MOSI);
+    uint8_t cardresult = init_sd_core(&card);
+    hard_assert(cardresult);
+
+    sd_card_block_dev(&device, &card);
+    uint8_t volresult = sd_volume_init(&volume, &device);
     hard_assert(volresult);
 
+#ifdef SD_BENCHMARK
+    setCrcMode(&card, TRUE);
+    benchCrcOn = benchReadBlocks(&card, volume.dataStartBlock_);
+    setCrcMode(&card, FALSE);
+    benchCrcOff = benchReadBlocks(&card, volume.dataStartBlock_);
+    setCrcMode(&card, TRUE);
+#endif
+
+#ifdef SD_STRIPE_BENCHMARK
+    // raw reads, the cards do not need to hold a striped volume
+    static sd_card card1;
+    static sd_stripe stripe;
+    sd_card_config(&card1, spi1, PIN1_MISO, PIN1_CS, PIN1_SCK, PIN1_MOSI);
+    // stripes of four blocks
+    if (sd_stripe_init(&stripe, &card, &card1, 2)) {
+        benchSingle = benchReadBlocks(&card, volume.dataStartBlock_);
+        benchStriped = benchStripeReadBlocks(&stripe, volume.dataStartBlock_);
+    }
+#endif
+
     uint8_t rootresult = openRoot(&rootdir, &volume);
     hard_assert(rootresult);
 
     uint8_t fileresult = sd_open(&rootdir, &file, "boot", O_READ);
     hard_assert(fileresult);
 
-    int16_t res = 0, i = 0;
     char buffer[32] = {0};
 
-    while ((res = sd_read(&file))>-1) {
-        buffer[i++] = (char)res;
-    }
+    int32_t res = sd_read_buf(&file, buffer, sizeof(buffer) - 1);
+    hard_assert(res >= 0);
 
-    buffer[i] = '\0';
+    buffer[res] = '\0';
 
     sd_close(&file);
 
@@ -0,0 +1,65 @@
+#include <string.h>
+#include "ram_disk.h"
+
+static uint8_t ramReadData(void* ctx, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+  ram_disk* disk = (ram_disk*)ctx;
+  if (block >= disk->blockCount_ || (count + offset) > 512) {
+    return false;
+  }
+  memcpy(dst, disk->data_ + ((uint32_t)block << 9) + offset, count);
+  return true;
+}
+
+static uint8_t ramReadBlocks(void* ctx, uint32_t block, uint32_t count, uint8_t* dst) {
+  ram_disk* disk = (ram_disk*)ctx;
+  if (block >= disk->blockCount_ || count > disk->blockCount_ - block) {
+    return false;
+  }
+  memcpy(dst, disk->data_ + ((uint32_t)block << 9), count << 9);
+  return true;
+}
+
+static uint8_t ramReadBlock(void* ctx, uint32_t block, uint8_t* dst) {
+  return ramReadBlocks(ctx, block, 1, dst);
+}
+
+static uint8_t ramWriteBlocks(void* ctx, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+  ram_disk* disk = (ram_disk*)ctx;
+  if (block >= disk->blockCount_ || count > disk->blockCount_ - block) {
+    return false;
+  }
+  (void)blocking;
+  memcpy(disk->data_ + ((uint32_t)block << 9), src, count << 9);
+  return true;
+}
+
+static uint8_t ramWriteBlock(void* ctx, uint32_t block, const uint8_t* src, uint8_t blocking) {
+  return ramWriteBlocks(ctx, block, 1, src, blocking);
+}
+
+static uint8_t ramSync(void* ctx) {
+  (void)ctx;
+  return true;
+}
+
+static uint32_t ramSectorCount(void* ctx) {
+  return ((ram_disk*)ctx)->blockCount_;
+}
+
+static const block_dev_ops ramDiskOps = {
+  ramReadData,
+  ramReadBlock,
+  ramWriteBlock,
+  ramReadBlocks,
+  ramWriteBlocks,
+  ramSync,
+  ramSectorCount
+};
+
+// Use blockCount * 512 bytes at data as a block device.
+void ram_disk_init(ram_disk* disk, block_dev* dev, uint8_t* data, uint32_t blockCount) {
+  disk->data_ = data;
+  disk->blockCount_ = blockCount;
+  dev->ops_ = &ramDiskOps;
+  dev->ctx_ = disk;
+}
@@ -0,0 +1,20 @@
+#ifndef __RAM_DISK_H
+#define __RAM_DISK_H
+
+#include "block_dev.h"
+
+/** Block device kept in a caller supplied buffer */
+typedef struct __RAM_DISK_PROT
+{
+  uint8_t* data_;
+  uint32_t blockCount_;
+} ram_disk;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void ram_disk_init(ram_disk* disk, block_dev* dev, uint8_t* data, uint32_t blockCount);
+#ifdef __cplusplus
+}
+#endif
+#endif
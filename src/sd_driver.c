@@ -1,22 +1,31 @@
+#include <string.h>
 #include <pico/stdlib.h>
 #include <pico/binary_info.h>
 #include <hardware/spi.h>
+#include <hardware/dma.h>
 #include "sd_driver.h"
 
-static uint8_t _reading;
-static uint16_t _offset;
-static uint8_t _status;
-static uint8_t _block;
-static uint8_t _partialBlock;
-static uint8_t _type;
+static uint8_t waitNotBusyFor(sd_card* card, uint8_t waitClass, unsigned int timeoutMillis);
+static uint8_t negotiateClock(sd_card* card);
+static uint8_t _writeBlock(sd_card* card, uint32_t blockNumber, const uint8_t* src, uint8_t blocking);
+static uint8_t _readBlocks(sd_card* card, uint32_t block, uint32_t count, uint8_t* dst);
+static uint8_t _writeBlocks(sd_card* card, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking);
+
+// values for dmaPending_
+#define DMA_PENDING_NONE 0
+#define DMA_PENDING_READ 1
+#define DMA_PENDING_WRITE 2
 
 // SD card commands
 #define CMD0        0x00
+#define CMD6        0x06
 #define CMD8        0x08
 #define CMD9        0x09
 #define CMD10       0x0A
+#define CMD12       0x0C
 #define CMD13       0x0D
 #define CMD17       0x11
+#define CMD18       0x12
 #define CMD24       0x18
 #define CMD25       0x19
 #define CMD32       0x20
@@ -24,6 +33,7 @@ static uint8_t _type;
 #define CMD38       0x26
 #define CMD55       0x37
 #define CMD58       0x3A
+#define CMD59       0x3B
 #define ACMD23      0x17
 #define ACMD41      0x29
 
@@ -36,6 +46,7 @@ static uint8_t _type;
 #define WRITE_MULTIPLE_TOKEN  0xFC
 #define DATA_RES_MASK  0x1F
 #define DATA_RES_ACCEPTED  0x05
+#define DATA_RES_CRC_ERROR  0x0B
 
 // card types
 /** Standard capacity V1 SD card */
@@ -90,6 +101,10 @@ static uint8_t _type;
 #define SD_CARD_ERROR_WRITE_TIMEOUT 0x15
 /** incorrect rate selected */
 #define SD_CARD_ERROR_SCK_RATE 0x16
+/** card returned an error response for CMD18 (read multiple block) */
+#define SD_CARD_ERROR_CMD18 0x17
+/** card returned an error response for CMD12 (stop transmission) */
+#define SD_CARD_ERROR_CMD12 0x18
 
 /** Protect block zero from write if nonzero */
 #define SD_PROTECT_BLOCK_ZERO 1
@@ -101,110 +116,375 @@ static uint8_t _type;
 #define SD_READ_TIMEOUT 300
 /** write time out ms */
 #define SD_WRITE_TIMEOUT 600
+/** minimum time to spin on the card before sleeping between polls, us */
+#define SD_SPIN_MIN_US 16
+/** maximum time to spin on the card before sleeping between polls, us */
+#define SD_SPIN_MAX_US 2000
+/** sleep between polls once the spin time is used up, us */
+#define SD_YIELD_US 20
+/** clock used while the card is initialized, Hz */
+#define SD_INIT_SCK_HZ 250000
+/** lowest clock the driver steps down to after errors, Hz */
+#define SD_MIN_SCK_HZ 400000
+/** highest clock the board wiring supports, Hz */
+#ifndef SD_MAX_SCK_HZ
+#define SD_MAX_SCK_HZ 50000000
+#endif
+/** attempts for a block transfer that fails, the second one at the same
+    clock and later ones after stepping the clock down */
+#define SD_MAX_RETRIES 4
+/** enable CRC checking with CMD59 at init if nonzero */
+#ifndef SD_USE_CRC
+#define SD_USE_CRC 1
+#endif
+/** transfers shorter than this are done with blocking SPI calls */
+#define SD_DMA_MIN_TRANSFER 32
+
+
+// CRC7 of commands, entries are shifted left one bit
+static const uint8_t crc7Table[256] = {
+    0X00, 0X12, 0X24, 0X36, 0X48, 0X5A, 0X6C, 0X7E, 0X90, 0X82, 0XB4, 0XA6, 0XD8, 0XCA, 0XFC, 0XEE,
+    0X32, 0X20, 0X16, 0X04, 0X7A, 0X68, 0X5E, 0X4C, 0XA2, 0XB0, 0X86, 0X94, 0XEA, 0XF8, 0XCE, 0XDC,
+    0X64, 0X76, 0X40, 0X52, 0X2C, 0X3E, 0X08, 0X1A, 0XF4, 0XE6, 0XD0, 0XC2, 0XBC, 0XAE, 0X98, 0X8A,
+    0X56, 0X44, 0X72, 0X60, 0X1E, 0X0C, 0X3A, 0X28, 0XC6, 0XD4, 0XE2, 0XF0, 0X8E, 0X9C, 0XAA, 0XB8,
+    0XC8, 0XDA, 0XEC, 0XFE, 0X80, 0X92, 0XA4, 0XB6, 0X58, 0X4A, 0X7C, 0X6E, 0X10, 0X02, 0X34, 0X26,
+    0XFA, 0XE8, 0XDE, 0XCC, 0XB2, 0XA0, 0X96, 0X84, 0X6A, 0X78, 0X4E, 0X5C, 0X22, 0X30, 0X06, 0X14,
+    0XAC, 0XBE, 0X88, 0X9A, 0XE4, 0XF6, 0XC0, 0XD2, 0X3C, 0X2E, 0X18, 0X0A, 0X74, 0X66, 0X50, 0X42,
+    0X9E, 0X8C, 0XBA, 0XA8, 0XD6, 0XC4, 0XF2, 0XE0, 0X0E, 0X1C, 0X2A, 0X38, 0X46, 0X54, 0X62, 0X70,
+    0X82, 0X90, 0XA6, 0XB4, 0XCA, 0XD8, 0XEE, 0XFC, 0X12, 0X00, 0X36, 0X24, 0X5A, 0X48, 0X7E, 0X6C,
+    0XB0, 0XA2, 0X94, 0X86, 0XF8, 0XEA, 0XDC, 0XCE, 0X20, 0X32, 0X04, 0X16, 0X68, 0X7A, 0X4C, 0X5E,
+    0XE6, 0XF4, 0XC2, 0XD0, 0XAE, 0XBC, 0X8A, 0X98, 0X76, 0X64, 0X52, 0X40, 0X3E, 0X2C, 0X1A, 0X08,
+    0XD4, 0XC6, 0XF0, 0XE2, 0X9C, 0X8E, 0XB8, 0XAA, 0X44, 0X56, 0X60, 0X72, 0X0C, 0X1E, 0X28, 0X3A,
+    0X4A, 0X58, 0X6E, 0X7C, 0X02, 0X10, 0X26, 0X34, 0XDA, 0XC8, 0XFE, 0XEC, 0X92, 0X80, 0XB6, 0XA4,
+    0X78, 0X6A, 0X5C, 0X4E, 0X30, 0X22, 0X14, 0X06, 0XE8, 0XFA, 0XCC, 0XDE, 0XA0, 0XB2, 0X84, 0X96,
+    0X2E, 0X3C, 0X0A, 0X18, 0X66, 0X74, 0X42, 0X50, 0XBE, 0XAC, 0X9A, 0X88, 0XF6, 0XE4, 0XD2, 0XC0,
+    0X1C, 0X0E, 0X38, 0X2A, 0X54, 0X46, 0X70, 0X62, 0X8C, 0X9E, 0XA8, 0XBA, 0XC4, 0XD6, 0XE0, 0XF2,
+};
 
+// CRC16-CCITT of data blocks
+static const uint16_t crc16Table[256] = {
+    0X0000, 0X1021, 0X2042, 0X3063, 0X4084, 0X50A5, 0X60C6, 0X70E7,
+    0X8108, 0X9129, 0XA14A, 0XB16B, 0XC18C, 0XD1AD, 0XE1CE, 0XF1EF,
+    0X1231, 0X0210, 0X3273, 0X2252, 0X52B5, 0X4294, 0X72F7, 0X62D6,
+    0X9339, 0X8318, 0XB37B, 0XA35A, 0XD3BD, 0XC39C, 0XF3FF, 0XE3DE,
+    0X2462, 0X3443, 0X0420, 0X1401, 0X64E6, 0X74C7, 0X44A4, 0X5485,
+    0XA56A, 0XB54B, 0X8528, 0X9509, 0XE5EE, 0XF5CF, 0XC5AC, 0XD58D,
+    0X3653, 0X2672, 0X1611, 0X0630, 0X76D7, 0X66F6, 0X5695, 0X46B4,
+    0XB75B, 0XA77A, 0X9719, 0X8738, 0XF7DF, 0XE7FE, 0XD79D, 0XC7BC,
+    0X48C4, 0X58E5, 0X6886, 0X78A7, 0X0840, 0X1861, 0X2802, 0X3823,
+    0XC9CC, 0XD9ED, 0XE98E, 0XF9AF, 0X8948, 0X9969, 0XA90A, 0XB92B,
+    0X5AF5, 0X4AD4, 0X7AB7, 0X6A96, 0X1A71, 0X0A50, 0X3A33, 0X2A12,
+    0XDBFD, 0XCBDC, 0XFBBF, 0XEB9E, 0X9B79, 0X8B58, 0XBB3B, 0XAB1A,
+    0X6CA6, 0X7C87, 0X4CE4, 0X5CC5, 0X2C22, 0X3C03, 0X0C60, 0X1C41,
+    0XEDAE, 0XFD8F, 0XCDEC, 0XDDCD, 0XAD2A, 0XBD0B, 0X8D68, 0X9D49,
+    0X7E97, 0X6EB6, 0X5ED5, 0X4EF4, 0X3E13, 0X2E32, 0X1E51, 0X0E70,
+    0XFF9F, 0XEFBE, 0XDFDD, 0XCFFC, 0XBF1B, 0XAF3A, 0X9F59, 0X8F78,
+    0X9188, 0X81A9, 0XB1CA, 0XA1EB, 0XD10C, 0XC12D, 0XF14E, 0XE16F,
+    0X1080, 0X00A1, 0X30C2, 0X20E3, 0X5004, 0X4025, 0X7046, 0X6067,
+    0X83B9, 0X9398, 0XA3FB, 0XB3DA, 0XC33D, 0XD31C, 0XE37F, 0XF35E,
+    0X02B1, 0X1290, 0X22F3, 0X32D2, 0X4235, 0X5214, 0X6277, 0X7256,
+    0XB5EA, 0XA5CB, 0X95A8, 0X8589, 0XF56E, 0XE54F, 0XD52C, 0XC50D,
+    0X34E2, 0X24C3, 0X14A0, 0X0481, 0X7466, 0X6447, 0X5424, 0X4405,
+    0XA7DB, 0XB7FA, 0X8799, 0X97B8, 0XE75F, 0XF77E, 0XC71D, 0XD73C,
+    0X26D3, 0X36F2, 0X0691, 0X16B0, 0X6657, 0X7676, 0X4615, 0X5634,
+    0XD94C, 0XC96D, 0XF90E, 0XE92F, 0X99C8, 0X89E9, 0XB98A, 0XA9AB,
+    0X5844, 0X4865, 0X7806, 0X6827, 0X18C0, 0X08E1, 0X3882, 0X28A3,
+    0XCB7D, 0XDB5C, 0XEB3F, 0XFB1E, 0X8BF9, 0X9BD8, 0XABBB, 0XBB9A,
+    0X4A75, 0X5A54, 0X6A37, 0X7A16, 0X0AF1, 0X1AD0, 0X2AB3, 0X3A92,
+    0XFD2E, 0XED0F, 0XDD6C, 0XCD4D, 0XBDAA, 0XAD8B, 0X9DE8, 0X8DC9,
+    0X7C26, 0X6C07, 0X5C64, 0X4C45, 0X3CA2, 0X2C83, 0X1CE0, 0X0CC1,
+    0XEF1F, 0XFF3E, 0XCF5D, 0XDF7C, 0XAF9B, 0XBFBA, 0X8FD9, 0X9FF8,
+    0X6E17, 0X7E36, 0X4E55, 0X5E74, 0X2E93, 0X3EB2, 0X0ED1, 0X1EF0,
+};
 
+// command checksum with end bit set
+static inline uint8_t crc7(const uint8_t* data, uint8_t n) {
+    uint8_t crc = 0;
+    while (n--) {
+        crc = crc7Table[crc ^ *data++];
+    }
+    return crc | 1;
+}
 
-static inline void send_spi_data(uint8_t value) {
+static inline uint16_t crc16Update(uint16_t crc, uint8_t b) {
+    return (crc << 8) ^ crc16Table[(crc >> 8) ^ b];
+}
+
+static uint16_t crc16(const uint8_t* data, uint16_t n) {
+    uint16_t crc = 0;
+    while (n--) {
+        crc = crc16Update(crc, *data++);
+    }
+    return crc;
+}
+
+static inline void send_spi_data(sd_card* card, uint8_t value) {
     uint8_t buffer[] = {value};
     // sleep_ms(10);
-    spi_write_blocking(spi0, buffer, 1);
+    spi_write_blocking(card->spi_, buffer, 1);
 }
 
-static inline uint8_t get_response() {
+static void recordLatency(sd_card* card, uint8_t waitClass, uint32_t micros) {
+    sd_latency* l = &card->latency_[waitClass];
+    l->last = micros;
+    if (l->count == 0 || micros < l->min) {
+        l->min = micros;
+    }
+    if (micros > l->max) {
+        l->max = micros;
+    }
+    // moving average weighted 1/8 toward the newest sample
+    l->avg = l->count ? (7 * l->avg + micros) >> 3 : micros;
+    l->count++;
+}
+
+static inline uint8_t get_response(sd_card* card) {
     uint8_t buffer[] = {0};
     // sleep_ms(10);
-    spi_read_blocking(spi0, 0xff, buffer, 1);
+    spi_read_blocking(card->spi_, 0xff, buffer, 1);
     return buffer[0];
 }
 
-uint8_t init_sd_core() {
+// Start a paired TX/RX DMA transfer of count bytes. If src is NULL 0xFF
+// fill bytes are sent, if dst is NULL received bytes are discarded.
+static void dmaStart(sd_card* card, const uint8_t* src, uint8_t* dst, uint16_t count) {
+    dma_channel_config tx = dma_channel_get_default_config(card->dmaTx_);
+    channel_config_set_transfer_data_size(&tx, DMA_SIZE_8);
+    channel_config_set_read_increment(&tx, src != NULL);
+    channel_config_set_write_increment(&tx, false);
+    channel_config_set_dreq(&tx, spi_get_dreq(card->spi_, true));
+    dma_channel_configure(card->dmaTx_, &tx, &spi_get_hw(card->spi_)->dr,
+                          src ? src : &card->dmaFill_, count, false);
+
+    dma_channel_config rx = dma_channel_get_default_config(card->dmaRx_);
+    channel_config_set_transfer_data_size(&rx, DMA_SIZE_8);
+    channel_config_set_read_increment(&rx, false);
+    channel_config_set_write_increment(&rx, dst != NULL);
+    channel_config_set_dreq(&rx, spi_get_dreq(card->spi_, false));
+    dma_channel_configure(card->dmaRx_, &rx, dst ? dst : &card->dmaSink_,
+                          &spi_get_hw(card->spi_)->dr, count, false);
+
+    // start both channels together so RX never falls behind TX
+    dma_start_channel_mask((1u << card->dmaTx_) | (1u << card->dmaRx_));
+}
+
+// RX completes last so it tells when the whole transfer is done
+static inline void dmaWait(sd_card* card) {
+    dma_channel_wait_for_finish_blocking(card->dmaRx_);
+}
+
+// receive count bytes, using DMA for large transfers
+static void spiReceive(sd_card* card, uint8_t* dst, uint16_t count) {
+    if (count < SD_DMA_MIN_TRANSFER) {
+        spi_read_blocking(card->spi_, 0xff, dst, count);
+        return;
+    }
+    dmaStart(card, NULL, dst, count);
+    dmaWait(card);
+}
+
+// Read the two checksum bytes after a data block and compare them with
+// crc if CRC checking is on.
+static uint8_t checkCrc(sd_card* card, uint16_t crc) {
+    uint16_t cardCrc = get_response(card) << 8;
+    cardCrc |= get_response(card);
+    if (card->crcEnabled_ && cardCrc != crc) {
+        // error(SD_CARD_ERROR_READ_CRC);
+        card->crcErrors_++;
+        return false;
+    }
+    return true;
+}
 
-    _partialBlock = _status = _offset = _reading = 0;
+// receive count bytes and their checksum
+static uint8_t receiveChecked(sd_card* card, uint8_t* dst, uint16_t count) {
+    spiReceive(card, dst, count);
+    return checkCrc(card, card->crcEnabled_ ? crc16(dst, count) : 0);
+}
 
-    spi_init(spi0, 250 * 1000);
-    gpio_set_function(PIN_MISO, GPIO_FUNC_SPI);
-    gpio_set_function(PIN_SCK, GPIO_FUNC_SPI);
-    gpio_set_function(PIN_MOSI, GPIO_FUNC_SPI);
-    gpio_pull_up(PIN_MISO);
-    gpio_pull_up(PIN_SCK);
-    gpio_pull_up(PIN_MOSI);
-    gpio_init(PIN_CS);
-    gpio_set_dir(PIN_CS, GPIO_OUT);
+// Wait for a 512 byte block started by dmaStart(card) and check it. The
+// checksum is computed over the bytes already stored while the rest of
+// the block is still arriving.
+static uint8_t receiveBlockFinish(sd_card* card, const uint8_t* dst) {
+    uint16_t crc = 0;
+    if (card->crcEnabled_) {
+        const uint8_t* end = dst + 512;
+        while (dst != end) {
+            const uint8_t* landed = (const uint8_t*)(uintptr_t)dma_channel_hw_addr(card->dmaRx_)->write_addr;
+            while (dst != landed) {
+                crc = crc16Update(crc, *dst++);
+            }
+        }
+    }
+    dmaWait(card);
+    return checkCrc(card, crc);
+}
 
-    chip_select_high();
+// Start sending a 512 byte block with DMA and compute its checksum while
+// it goes out.
+static void sendBlockStart(sd_card* card, const uint8_t* src) {
+    dmaStart(card, src, NULL, 512);
+    card->dmaCrc_ = card->crcEnabled_ ? crc16(src, 512) : 0XFFFF;
+}
+
+// finish a block started by sendBlockStart(card) and get the data response
+static uint8_t sendBlockFinish(sd_card* card) {
+    dmaWait(card);
+    uint8_t crc[] = {card->dmaCrc_ >> 8, card->dmaCrc_ & 0XFF};
+    spi_write_blocking(card->spi_, crc, 2);
+    card->status_ = get_response(card);
+    if ((card->status_ & DATA_RES_MASK) != DATA_RES_ACCEPTED) {
+        if ((card->status_ & DATA_RES_MASK) == DATA_RES_CRC_ERROR) {
+            card->crcErrors_++;
+        }
+        // error(SD_CARD_ERROR_WRITE);
+        return false;
+    }
+    return true;
+}
+
+// Decide if a failed transfer gets another attempt. The first retry runs
+// at the same clock since a single corrupted block is likely, later ones
+// step the clock down.
+uint8_t retryTransfer(sd_card* card, uint8_t attempt) {
+    if (attempt >= SD_MAX_RETRIES) {
+        return false;
+    }
+    return attempt == 1 || stepDownClock(card);
+}
+
+// send count bytes, using DMA for large transfers
+static void spiSend(sd_card* card, const uint8_t* src, uint16_t count) {
+    if (count < SD_DMA_MIN_TRANSFER) {
+        spi_write_blocking(card->spi_, src, count);
+        return;
+    }
+    dmaStart(card, src, NULL, count);
+    dmaWait(card);
+}
+
+// Set the bus and pins of a card before init_sd_core(). Each card needs
+// its own SPI instance so transfers on two cards can overlap.
+void sd_card_config(sd_card* card, spi_inst_t* spi, uint8_t pinMiso,
+                    uint8_t pinCs, uint8_t pinSck, uint8_t pinMosi) {
+    memset(card, 0, sizeof(sd_card));
+    card->spi_ = spi;
+    card->pinMiso_ = pinMiso;
+    card->pinCs_ = pinCs;
+    card->pinSck_ = pinSck;
+    card->pinMosi_ = pinMosi;
+    card->dmaTx_ = card->dmaRx_ = -1;
+}
+
+uint8_t init_sd_core(sd_card* card) {
+
+    card->partialBlock_ = card->status_ = card->offset_ = card->reading_ = 0;
+    card->multiRead_ = card->multiWrite_ = 0;
+    card->dmaPending_ = DMA_PENDING_NONE;
+
+    card->dmaFill_ = 0xFF;
+    if (card->dmaTx_ < 0) {
+        card->dmaTx_ = dma_claim_unused_channel(true);
+        card->dmaRx_ = dma_claim_unused_channel(true);
+    }
+
+    card->sckHz_ = spi_init(card->spi_, SD_INIT_SCK_HZ);
+    card->cardMaxHz_ = card->sckLimitHz_ = 0;
+    gpio_set_function(card->pinMiso_, GPIO_FUNC_SPI);
+    gpio_set_function(card->pinSck_, GPIO_FUNC_SPI);
+    gpio_set_function(card->pinMosi_, GPIO_FUNC_SPI);
+    gpio_pull_up(card->pinMiso_);
+    gpio_pull_up(card->pinSck_);
+    gpio_pull_up(card->pinMosi_);
+    gpio_init(card->pinCs_);
+    gpio_set_dir(card->pinCs_, GPIO_OUT);
+
+    chip_select_high(card);
 
     for (uint8_t i = 0; i < 10; i++) {
-        send_spi_data(0xff);
+        send_spi_data(card, 0xff);
     }
 
-    chip_select_low();
+    chip_select_low(card);
 
-    while((_status = cardCommand(CMD0, 0)) != R1_IDLE_STATE) {
+    while((card->status_ = cardCommand(card, CMD0, 0)) != R1_IDLE_STATE) {
         asm("nop");
     }
 
-    if ((cardCommand(CMD8, 0x1AA)) & R1_ILLEGAL_COMMAND) {
+    card->crcEnabled_ = false;
+    if (SD_USE_CRC) {
+        setCrcMode(card, TRUE);
+        chip_select_low(card);
+    }
+
+    if ((cardCommand(card, CMD8, 0x1AA)) & R1_ILLEGAL_COMMAND) {
         asm("nop");
         // set here sd card type V1
-        _type = SD_CARD_TYPE_SD1;
+        card->type_ = SD_CARD_TYPE_SD1;
     }
     else {
         for (uint8_t i = 0; i < 4; i++) {
-            _status = get_response();
+            card->status_ = get_response(card);
         }
 
-        if (_status != 0xaa) {
+        if (card->status_ != 0xaa) {
             // throw error here
             asm("nop");
         }
 
         // set here sd card type V2
-        _type = SD_CARD_TYPE_SD2;
+        card->type_ = SD_CARD_TYPE_SD2;
     }
 
-    uint32_t arg = (_type == SD_CARD_TYPE_SD2) ? 0x40000000 : 0;
+    uint32_t arg = (card->type_ == SD_CARD_TYPE_SD2) ? 0x40000000 : 0;
 
     // int wait_time = 5;
     
-    while(((_status = cardAcmd(ACMD41, arg)) != R1_READY_STATE)) {
+    while(((card->status_ = cardAcmd(card, ACMD41, arg)) != R1_READY_STATE)) {
         asm("nop");
         // wait_time--;
     }
 
     // if SD2 read OCR register to check for SDHC card
-    if (_type == SD_CARD_TYPE_SD2) {
-        if (cardCommand(CMD58, 0)) {
+    if (card->type_ == SD_CARD_TYPE_SD2) {
+        if (cardCommand(card, CMD58, 0)) {
             asm("nop");
         }
 
-        if ((get_response() & 0xC0) == 0xC0) {
+        if ((get_response(card) & 0xC0) == 0xC0) {
             // type(SD_CARD_TYPE_SDHC);
-            _type = SD_CARD_TYPE_SDHC;
+            card->type_ = SD_CARD_TYPE_SDHC;
         }
         // discard rest of ocr - contains allowed voltage range
         for (uint8_t i = 0; i < 3; i++) {
-            get_response();
+            get_response(card);
         }
     }
 
-    chip_select_high();
+    // leave the slow init clock
+    negotiateClock(card);
+
+    chip_select_high(card);
     return TRUE;
 fail:
-    chip_select_high();
+    chip_select_high(card);
     return FALSE;
 }
 
-uint8_t cardAcmd(uint8_t cmd, uint32_t arg) {
-    cardCommand(CMD55, 0);
-    return cardCommand(cmd, arg);
+uint8_t cardAcmd(sd_card* card, uint8_t cmd, uint32_t arg) {
+    cardCommand(card, CMD55, 0);
+    return cardCommand(card, cmd, arg);
 }
 
-uint8_t cardCommand(uint8_t cmd, uint32_t arg) {
-    flush();
+uint8_t cardCommand(sd_card* card, uint8_t cmd, uint32_t arg) {
+    flush(card);
 
-    chip_select_low();
+    chip_select_low(card);
 
-    waitNotBusy(300);
+    // the card is still streaming data when a read is stopped
+    if (cmd != CMD12) {
+        waitNotBusyFor(card, SD_WAIT_COMMAND, 300);
+    }
 
     uint8_t args[6];
     args[0] = cmd | 0x40;
@@ -213,19 +493,14 @@ uint8_t cardCommand(uint8_t cmd, uint32_t arg) {
         args[i] = (uint8_t)(arg >> s);
     }
 
-    uint8_t crc = 0xff;
+    args[5] = crc7(args, 5);
+    spi_write_blocking(card->spi_, args, 6);
 
-    if (cmd == CMD0) {
-        crc = 0x95;
+    // skip stuff byte for stop read
+    if (cmd == CMD12) {
+        get_response(card);
     }
 
-    if (cmd == CMD8) {
-        crc = 0x87;
-    }
-
-    args[5] = crc;
-    spi_write_blocking(spi0, args, 6);
-
 
     int i = 0;
 
@@ -234,81 +509,108 @@ uint8_t cardCommand(uint8_t cmd, uint32_t arg) {
         i++;
     }
 
-    while((_status = get_response())&0x80 && (i != 0xff));
-    return _status;
+    while((card->status_ = get_response(card))&0x80 && (i != 0xff));
+    return card->status_;
 }
 
-void flush() {
-    if (!_reading) return;
-    while(_offset++ < 514) {
-        get_response();
+void flush(sd_card* card) {
+    if (card->dmaPending_) {
+        transferFinish(card);
+    }
+    if (card->multiRead_) {
+        readStop(card);
+    }
+    if (card->multiWrite_) {
+        writeStop(card, true);
     }
-    chip_select_high();
-    _reading = 0;
+    if (!card->reading_) return;
+    while(card->offset_++ < 514) {
+        get_response(card);
+    }
+    chip_select_high(card);
+    card->reading_ = 0;
 }
 
-uint8_t readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+uint8_t readData(sd_card* card, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
     if (count == 0) {
         return TRUE;
     }
     if ((count + offset) > 512) {
         goto fail;
     }
-    if (!_reading || block != _block || offset < _offset) {
-        _block = block;
+    if (!card->reading_ || block != card->block_ || offset < card->offset_) {
+        card->block_ = block;
         // use address if not SDHC card
-        if (_type != SD_CARD_TYPE_SDHC) {
+        if (card->type_ != SD_CARD_TYPE_SDHC) {
             block <<= 9;
         }
-        if (cardCommand(CMD17, block)) {
+        if (cardCommand(card, CMD17, block)) {
             //   error(SD_CARD_ERROR_CMD17);
             goto fail;
         }
-        if (!waitStartBlock()) {
+        if (!waitStartBlock(card)) {
             goto fail;
         }
-        _offset = 0;
-        _reading = 1;
-
-        // skip data before offset
-        for (; _offset < offset; _offset++) {
-            get_response();
-        }
-        // transfer data in batch
-        spi_read_blocking(spi0, 0xff, dst, count);
-
-        _offset += count;
-        if (!_partialBlock || _offset >= 512) {
-            // read rest of data, checksum and set chip select high
-            flush();
-        }
-        return TRUE;
+        card->offset_ = 0;
+        card->reading_ = 1;
+    }
+    // skip data before offset
+    for (; card->offset_ < offset; card->offset_++) {
+        get_response(card);
+    }
+    if (count == 512) {
+        // whole block - receive it with its checksum
+        dmaStart(card, NULL, dst, 512);
+        uint8_t ok = receiveBlockFinish(card, dst);
+        card->reading_ = 0;
+        chip_select_high(card);
+        return ok;
+    }
+    // transfer data in batch
+    spiReceive(card, dst, count);
 
-        fail:
-        chip_select_high();
-        return FALSE;
+    card->offset_ += count;
+    if (!card->partialBlock_ || card->offset_ >= 512) {
+        // read rest of data, checksum and set chip select high
+        flush(card);
     }
+    return TRUE;
+
+    fail:
+    chip_select_high(card);
+    return FALSE;
 }
 
-uint8_t readBlock(uint32_t block, uint8_t* dst) {
-  return readData(block, 0, 512, dst);
+uint8_t readBlock(sd_card* card, uint32_t block, uint8_t* dst) {
+  for (uint8_t retry = 1; !readData(card, block, 0, 512, dst); retry++) {
+    if (!retryTransfer(card, retry)) {
+      return false;
+    }
+  }
+  return true;
 }
 
-uint8_t writeData(uint8_t token, const uint8_t* src) {
-    uint8_t temp[] = {0xff,0xff};
-    spi_write_blocking(spi0, temp, 2);
-    _status = get_response();
-    if ((_status & DATA_RES_MASK) != DATA_RES_ACCEPTED) {
-        // error(SD_CARD_ERROR_WRITE);
+uint8_t writeData(sd_card* card, uint8_t token, const uint8_t* src) {
+    send_spi_data(card, token);
+    sendBlockStart(card, src);
+    if (!sendBlockFinish(card)) {
         // chipSelectHigh();
-        chip_select_high();
+        chip_select_high(card);
         return false;
     }
     return true;
 }
 
+uint8_t writeBlock(sd_card* card, uint32_t blockNumber, const uint8_t* src, uint8_t blocking) {
+  for (uint8_t retry = 1; !_writeBlock(card, blockNumber, src, blocking); retry++) {
+    if (!retryTransfer(card, retry)) {
+      return false;
+    }
+  }
+  return true;
+}
 
-uint8_t writeBlock(uint32_t blockNumber, const uint8_t* src, uint8_t blocking) {
+static uint8_t _writeBlock(sd_card* card, uint32_t blockNumber, const uint8_t* src, uint8_t blocking) {
     #if SD_PROTECT_BLOCK_ZERO
     // don't allow write to first block
     if (blockNumber == 0) {
@@ -318,73 +620,625 @@ uint8_t writeBlock(uint32_t blockNumber, const uint8_t* src, uint8_t blocking) {
     #endif  // SD_PROTECT_BLOCK_ZERO
 
     // use address if not SDHC card
-    if (_type != SD_CARD_TYPE_SDHC) {
+    if (card->type_ != SD_CARD_TYPE_SDHC) {
         blockNumber <<= 9;
     }
-    if (cardCommand(CMD24, blockNumber)) {
+    if (cardCommand(card, CMD24, blockNumber)) {
         // error(SD_CARD_ERROR_CMD24);
         goto fail;
     }
-    if (!writeData(DATA_START_BLOCK, src)) {
+    if (!writeData(card, DATA_START_BLOCK, src)) {
         goto fail;
     }
     if (blocking) {
         // wait for flash programming to complete
-        if (!waitNotBusy(SD_WRITE_TIMEOUT)) {
+        if (!waitNotBusy(card, SD_WRITE_TIMEOUT)) {
         // error(SD_CARD_ERROR_WRITE_TIMEOUT);
             goto fail;
         }
         // response is r2 so get and check two bytes for nonzero
-        if (cardCommand(CMD13, 0) || get_response()) {
+        if (cardCommand(card, CMD13, 0) || get_response(card)) {
         // error(SD_CARD_ERROR_WRITE_PROGRAMMING);
             goto fail;
         }
     }
     // chipSelectHigh();
-    chip_select_high();
+    chip_select_high(card);
     return true;
 
     fail:
     //   chipSelectHigh();
-    chip_select_high();
+    chip_select_high(card);
     return false;
 }
 
-uint8_t waitStartBlock() {
-//   unsigned int t0 = millis();
-unsigned int d = 0;
-  while ((_status = get_response()) == 0xFF) {
-    asm("nop");
-    // unsigned int d = millis() - t0;
-    if (d > SD_READ_TIMEOUT) {
-    //   error(SD_CARD_ERROR_READ_TIMEOUT);
-      goto fail;
+// Poll the card until it answers something other than 0xFF (busy is
+// false) or until it answers 0xFF (busy is true). Polling spins for about
+// twice the average latency seen for waitClass, then sleeps a little
+// between polls so a slow card does not hold the core. Returns the last
+// response, or sets *timedOut if the deadline passed.
+static uint8_t waitResponse(sd_card* card, uint8_t waitClass, uint8_t busy,
+                            uint32_t timeoutMillis, uint8_t* timedOut) {
+  uint64_t t0 = time_us_64();
+  uint64_t deadline = t0 + 1000ULL * timeoutMillis;
+  uint32_t spin = 2 * card->latency_[waitClass].avg;
+  if (spin < SD_SPIN_MIN_US) {
+    spin = SD_SPIN_MIN_US;
+  } else if (spin > SD_SPIN_MAX_US) {
+    spin = SD_SPIN_MAX_US;
+  }
+  uint64_t spinEnd = t0 + spin;
+  uint8_t r;
+  *timedOut = false;
+  while (((r = get_response(card)) == 0xFF) != busy) {
+    uint64_t now = time_us_64();
+    if (now >= deadline) {
+      *timedOut = true;
+      return r;
+    }
+    if (now >= spinEnd) {
+      sleep_us(SD_YIELD_US);
     }
-    d++;
-    sleep_ms(1);
   }
-  if (_status != DATA_START_BLOCK) {
+  recordLatency(card, waitClass, (uint32_t)(time_us_64() - t0));
+  return r;
+}
+
+uint8_t waitStartBlock(sd_card* card) {
+  uint8_t timedOut;
+  uint8_t waitClass = card->multiRead_ ? SD_WAIT_READ_MULTIPLE : SD_WAIT_READ_SINGLE;
+  card->status_ = waitResponse(card, waitClass, false, SD_READ_TIMEOUT, &timedOut);
+  if (timedOut) {
+    // error(SD_CARD_ERROR_READ_TIMEOUT);
+    goto fail;
+  }
+  if (card->status_ != DATA_START_BLOCK) {
     // error(SD_CARD_ERROR_READ);
     goto fail;
   }
   return true;
 
 fail:
-  chip_select_high();
+  chip_select_high(card);
   return false;
 }
 
+static uint8_t waitNotBusyFor(sd_card* card, uint8_t waitClass, unsigned int timeoutMillis) {
+  uint8_t timedOut;
+  waitResponse(card, waitClass, true, timeoutMillis, &timedOut);
+  return !timedOut;
+}
+
 // wait for card to go not busy
-uint8_t waitNotBusy(unsigned int timeoutMillis) {
-//   unsigned int t0 = millis();
-  unsigned int d = 0;
-  do {
-    if (get_response() == 0xFF) {
-      return true;
-    }
-    sleep_ms(1);
-    d++;
-    // d = millis() - t0;
-  } while (d < timeoutMillis);
-  return false;
+uint8_t waitNotBusy(sd_card* card, unsigned int timeoutMillis) {
+  return waitNotBusyFor(card, SD_WAIT_WRITE, timeoutMillis);
+}
+
+// Copy the token latency statistics recorded for waitClass.
+uint8_t waitLatency(sd_card* card, uint8_t waitClass, sd_latency* latency) {
+  if (waitClass >= SD_WAIT_CLASSES) {
+    return false;
+  }
+  *latency = card->latency_[waitClass];
+  return true;
+}
+
+// Start reading a block with DMA. The card is left selected until
+// transferFinish(card) collects the checksum.
+uint8_t readBlockStart(sd_card* card, uint32_t block, uint8_t* dst) {
+    card->block_ = block;
+    // use address if not SDHC card
+    if (card->type_ != SD_CARD_TYPE_SDHC) {
+        block <<= 9;
+    }
+    if (cardCommand(card, CMD17, block)) {
+        // error(SD_CARD_ERROR_CMD17);
+        goto fail;
+    }
+    if (!waitStartBlock(card)) {
+        goto fail;
+    }
+    dmaStart(card, NULL, dst, 512);
+    card->dmaDst_ = dst;
+    card->dmaPending_ = DMA_PENDING_READ;
+    return true;
+
+fail:
+    chip_select_high(card);
+    return false;
+}
+
+// Start writing a block with DMA. Programming is not waited for, the next
+// command waits for the card to go not busy.
+uint8_t writeBlockStart(sd_card* card, uint32_t blockNumber, const uint8_t* src) {
+    #if SD_PROTECT_BLOCK_ZERO
+    // don't allow write to first block
+    if (blockNumber == 0) {
+        // error(SD_CARD_ERROR_WRITE_BLOCK_ZERO);
+        goto fail;
+    }
+    #endif  // SD_PROTECT_BLOCK_ZERO
+
+    // use address if not SDHC card
+    if (card->type_ != SD_CARD_TYPE_SDHC) {
+        blockNumber <<= 9;
+    }
+    if (cardCommand(card, CMD24, blockNumber)) {
+        // error(SD_CARD_ERROR_CMD24);
+        goto fail;
+    }
+    send_spi_data(card, DATA_START_BLOCK);
+    sendBlockStart(card, src);
+    card->dmaPending_ = DMA_PENDING_WRITE;
+    return true;
+
+fail:
+    chip_select_high(card);
+    return false;
+}
+
+// true while a transfer started by readBlockStart(card) or writeBlockStart(card)
+// is still moving data
+uint8_t transferBusy(sd_card* card) {
+    return card->dmaPending_ && dma_channel_is_busy(card->dmaRx_);
+}
+
+// Wait for the pending transfer and complete the block protocol.
+// Returns false if the card rejected a written block.
+uint8_t transferFinish(sd_card* card) {
+    uint8_t pending = card->dmaPending_;
+    if (!pending) {
+        return true;
+    }
+    card->dmaPending_ = DMA_PENDING_NONE;
+
+    if (pending == DMA_PENDING_READ) {
+        uint8_t ok = receiveBlockFinish(card, card->dmaDst_);
+        // keep the card selected for the next block of a CMD18 read
+        if (!card->multiRead_) {
+            chip_select_high(card);
+        }
+        return ok;
+    }
+    if (!sendBlockFinish(card)) {
+        card->multiWrite_ = 0;
+        chip_select_high(card);
+        return false;
+    }
+    // keep the card selected for the next block of a CMD25 write
+    if (!card->multiWrite_) {
+        chip_select_high(card);
+    }
+    return true;
+}
+
+// Start a CMD18 multiple block read. Blocks are fetched with readNext(card)
+// until readStop(card) is called.
+uint8_t readStart(sd_card* card, uint32_t block) {
+    // use address if not SDHC card
+    if (card->type_ != SD_CARD_TYPE_SDHC) {
+        block <<= 9;
+    }
+    if (cardCommand(card, CMD18, block)) {
+        // error(SD_CARD_ERROR_CMD18);
+        goto fail;
+    }
+    card->multiRead_ = 1;
+    return true;
+
+fail:
+    chip_select_high(card);
+    return false;
+}
+
+// Wait for the next block of a CMD18 read and start moving it with DMA.
+// Complete it with transferFinish(card).
+uint8_t readNextStart(sd_card* card, uint8_t* dst) {
+    if (!card->multiRead_) {
+        return false;
+    }
+    // finish the previous block
+    if (!transferFinish(card)) {
+        return false;
+    }
+    if (!waitStartBlock(card)) {
+        readStop(card);
+        return false;
+    }
+    dmaStart(card, NULL, dst, 512);
+    card->dmaDst_ = dst;
+    card->dmaPending_ = DMA_PENDING_READ;
+    return true;
+}
+
+uint8_t readNext(sd_card* card, uint8_t* dst) {
+    if (!readNextStart(card, dst)) {
+        return false;
+    }
+    return transferFinish(card);
+}
+
+// end a CMD18 read with STOP_TRANSMISSION
+uint8_t readStop(sd_card* card) {
+    if (!card->multiRead_) {
+        return true;
+    }
+    transferFinish(card);
+    card->multiRead_ = 0;
+    if (cardCommand(card, CMD12, 0)) {
+        // error(SD_CARD_ERROR_CMD12);
+        goto fail;
+    }
+    chip_select_high(card);
+    return true;
+
+fail:
+    chip_select_high(card);
+    return false;
+}
+
+// read count contiguous blocks into dst
+uint8_t readBlocks(sd_card* card, uint32_t block, uint32_t count, uint8_t* dst) {
+  for (uint8_t retry = 1; !_readBlocks(card, block, count, dst); retry++) {
+    if (!retryTransfer(card, retry)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint8_t _readBlocks(sd_card* card, uint32_t block, uint32_t count, uint8_t* dst) {
+    if (count == 1) {
+        // readBlocks() retries, not readBlock()
+        return readData(card, block, 0, 512, dst);
+    }
+    if (!readStart(card, block)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++, dst += 512) {
+        if (!readNext(card, dst)) {
+            readStop(card);
+            return false;
+        }
+    }
+    return readStop(card);
+}
+
+// Start a CMD25 multiple block write of count blocks. ACMD23 lets the
+// card pre-erase the whole range before the data arrives.
+uint8_t writeStart(sd_card* card, uint32_t blockNumber, uint32_t count) {
+    #if SD_PROTECT_BLOCK_ZERO
+    // don't allow write to first block
+    if (blockNumber == 0) {
+        // error(SD_CARD_ERROR_WRITE_BLOCK_ZERO);
+        goto fail;
+    }
+    #endif  // SD_PROTECT_BLOCK_ZERO
+
+    // send pre-erase count
+    if (cardAcmd(card, ACMD23, count)) {
+        // error(SD_CARD_ERROR_ACMD23);
+        goto fail;
+    }
+    // use address if not SDHC card
+    if (card->type_ != SD_CARD_TYPE_SDHC) {
+        blockNumber <<= 9;
+    }
+    if (cardCommand(card, CMD25, blockNumber)) {
+        // error(SD_CARD_ERROR_CMD25);
+        goto fail;
+    }
+    card->multiWrite_ = 1;
+    return true;
+
+fail:
+    chip_select_high(card);
+    return false;
+}
+
+// Send the next block of a CMD25 write with DMA. Complete it with
+// transferFinish(card).
+uint8_t writeNextStart(sd_card* card, const uint8_t* src) {
+    if (!card->multiWrite_) {
+        return false;
+    }
+    // finish the previous block
+    if (!transferFinish(card)) {
+        return false;
+    }
+    // wait for previous block to be programmed
+    if (!waitNotBusy(card, SD_WRITE_TIMEOUT)) {
+        // error(SD_CARD_ERROR_WRITE_MULTIPLE);
+        card->multiWrite_ = 0;
+        chip_select_high(card);
+        return false;
+    }
+    send_spi_data(card, WRITE_MULTIPLE_TOKEN);
+    sendBlockStart(card, src);
+    card->dmaPending_ = DMA_PENDING_WRITE;
+    return true;
+}
+
+uint8_t writeNextBlock(sd_card* card, const uint8_t* src) {
+    if (!writeNextStart(card, src)) {
+        return false;
+    }
+    return transferFinish(card);
+}
+
+// end a CMD25 write with STOP_TRAN_TOKEN, blocking zero returns
+// without waiting for the card to finish programming
+uint8_t writeStop(sd_card* card, uint8_t blocking) {
+    if (!card->multiWrite_) {
+        return true;
+    }
+    transferFinish(card);
+    card->multiWrite_ = 0;
+    if (!waitNotBusy(card, SD_WRITE_TIMEOUT)) {
+        goto fail;
+    }
+    send_spi_data(card, STOP_TRAN_TOKEN);
+    if (blocking && !waitNotBusy(card, SD_WRITE_TIMEOUT)) {
+        // error(SD_CARD_ERROR_STOP_TRAN);
+        goto fail;
+    }
+    chip_select_high(card);
+    return true;
+
+fail:
+    chip_select_high(card);
+    return false;
+}
+
+// write count contiguous blocks from src
+uint8_t writeBlocks(sd_card* card, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+  for (uint8_t retry = 1; !_writeBlocks(card, block, count, src, blocking); retry++) {
+    if (!retryTransfer(card, retry)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint8_t _writeBlocks(sd_card* card, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+    if (count == 1) {
+        // writeBlocks() retries, not writeBlock()
+        return _writeBlock(card, block, src, blocking);
+    }
+    if (!writeStart(card, block, count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++, src += 512) {
+        if (!writeNextBlock(card, src)) {
+            writeStop(card, true);
+            return false;
+        }
+    }
+    return writeStop(card, blocking);
+}
+
+// read a 16 byte CSD or CID register
+static uint8_t readRegister(sd_card* card, uint8_t cmd, uint8_t* buf) {
+    if (cardCommand(card, cmd, 0)) {
+        // error(SD_CARD_ERROR_READ_REG);
+        goto fail;
+    }
+    if (!waitStartBlock(card)) {
+        goto fail;
+    }
+    if (!receiveChecked(card, buf, 16)) {
+        goto fail;
+    }
+    chip_select_high(card);
+    return true;
+
+fail:
+    chip_select_high(card);
+    return false;
+}
+
+uint8_t readCSD(sd_card* card, uint8_t* csd) {
+    return readRegister(card, CMD9, csd);
+}
+
+uint8_t readCID(sd_card* card, uint8_t* cid) {
+    return readRegister(card, CMD10, cid);
+}
+
+// maximum transfer rate from the CSD TRAN_SPEED field, Hz
+static uint32_t csdTranSpeed(const uint8_t* csd) {
+    // time value in tenths, indexed by bits 6:3
+    static const uint8_t value[16] = {
+        0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+    };
+    uint8_t unit = csd[3] & 0X7;
+    if (unit > 3) {
+        return 0;
+    }
+    uint32_t rate = 10000UL * value[(csd[3] >> 3) & 0XF];
+    while (unit--) {
+        rate *= 10;
+    }
+    return rate;
+}
+
+// card size in 512 byte blocks from the CSD, zero if the CSD is not valid
+uint32_t cardSizeFromCSD(const uint8_t* csd) {
+    if ((csd[0] >> 6) == 0) {
+        // CSD version 1.0
+        uint32_t cSize = ((uint32_t)(csd[6] & 0X3) << 10) | ((uint32_t)csd[7] << 2) | (csd[8] >> 6);
+        uint8_t cSizeMult = ((csd[9] & 0X3) << 1) | (csd[10] >> 7);
+        uint8_t readBlLen = csd[5] & 0XF;
+        return (cSize + 1) << (cSizeMult + readBlLen + 2 - 9);
+    } else if ((csd[0] >> 6) == 1) {
+        // CSD version 2.0
+        uint32_t cSize = ((uint32_t)(csd[7] & 0X3F) << 16) | ((uint32_t)csd[8] << 8) | csd[9];
+        return (cSize + 1) << 10;
+    }
+    // error(SD_CARD_ERROR_BAD_CSD);
+    return 0;
+}
+
+// card size in 512 byte blocks, zero if the CSD can't be read
+uint32_t cardSize(sd_card* card) {
+    uint8_t csd[16];
+    return readCSD(card, csd) ? cardSizeFromCSD(csd) : 0;
+}
+
+// Ask the card to switch to high speed timing. Returns true if the card
+// accepted function 1 of the access mode group.
+static uint8_t switchHighSpeed(sd_card* card) {
+    uint8_t status[64];
+    if (cardCommand(card, CMD6, 0X80FFFFF1)) {
+        goto fail;
+    }
+    if (!waitStartBlock(card)) {
+        goto fail;
+    }
+    if (!receiveChecked(card, status, 64)) {
+        goto fail;
+    }
+    chip_select_high(card);
+    return (status[16] & 0XF) == 1;
+
+fail:
+    chip_select_high(card);
+    return false;
+}
+
+// set the SPI clock, limited by board and card, and remember what the
+// peripheral actually runs at
+static void setClock(sd_card* card, uint32_t hz) {
+    if (hz > SD_MAX_SCK_HZ) {
+        hz = SD_MAX_SCK_HZ;
+    }
+    if (card->sckLimitHz_ && hz > card->sckLimitHz_) {
+        hz = card->sckLimitHz_;
+    }
+    card->sckHz_ = spi_set_baudrate(card->spi_, hz);
+}
+
+// Raise the SPI clock to the fastest rate both the card and the board
+// support. Cards that support the switch function class are moved to high
+// speed timing first when the board can go above 25 MHz.
+static uint8_t negotiateClock(sd_card* card) {
+    uint8_t csd[16];
+    if (!readCSD(card, csd)) {
+        return false;
+    }
+    card->cardMaxHz_ = csdTranSpeed(csd);
+    if (card->cardMaxHz_ == 0) {
+        return false;
+    }
+    // command class 10 is the switch function
+    uint16_t ccc = ((uint16_t)csd[4] << 4) | (csd[5] >> 4);
+    if (SD_MAX_SCK_HZ > card->cardMaxHz_ && (ccc & (1 << 10)) && switchHighSpeed(card)) {
+        // TRAN_SPEED is updated after the switch
+        if (readCSD(card, csd)) {
+            card->cardMaxHz_ = csdTranSpeed(csd);
+        }
+    }
+    card->sckLimitHz_ = card->cardMaxHz_;
+    setClock(card, card->cardMaxHz_);
+    return true;
+}
+
+// Drop to the next lower clock after a transfer error. Returns false if
+// the clock is already at the minimum.
+uint8_t stepDownClock(sd_card* card) {
+    if (card->sckHz_ <= SD_MIN_SCK_HZ) {
+        return false;
+    }
+    uint32_t hz = card->sckHz_ / 2;
+    if (hz < SD_MIN_SCK_HZ) {
+        hz = SD_MIN_SCK_HZ;
+    }
+    // never go back above the failing rate
+    card->sckLimitHz_ = hz;
+    setClock(card, hz);
+    return true;
+}
+
+// SPI clock in use, Hz
+uint32_t clockRate(sd_card* card) {
+    return card->sckHz_;
+}
+
+// highest clock the card reported, Hz
+uint32_t cardClockLimit(sd_card* card) {
+    return card->cardMaxHz_;
+}
+
+// Turn CRC checking of commands and data on or off with CMD59.
+uint8_t setCrcMode(sd_card* card, uint8_t enable) {
+    if (cardCommand(card, CMD59, enable ? 1 : 0) & ~R1_IDLE_STATE) {
+        chip_select_high(card);
+        return false;
+    }
+    chip_select_high(card);
+    card->crcEnabled_ = enable;
+    return true;
+}
+
+uint8_t crcMode(sd_card* card) {
+    return card->crcEnabled_;
+}
+
+// number of data blocks that failed CRC since init
+uint32_t crcErrors(sd_card* card) {
+    return card->crcErrors_;
+}
+
+// wait for the card to finish programming
+uint8_t syncCard(sd_card* card) {
+    flush(card);
+    chip_select_low(card);
+    uint8_t ok = waitNotBusy(card, SD_WRITE_TIMEOUT);
+    chip_select_high(card);
+    return ok;
+}
+
+// block_dev operations of a card
+static uint8_t cardReadData(void* ctx, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+    return readData((sd_card*)ctx, block, offset, count, dst);
+}
+
+static uint8_t cardReadBlock(void* ctx, uint32_t block, uint8_t* dst) {
+    return readBlock((sd_card*)ctx, block, dst);
+}
+
+static uint8_t cardWriteBlock(void* ctx, uint32_t block, const uint8_t* src, uint8_t blocking) {
+    return writeBlock((sd_card*)ctx, block, src, blocking);
+}
+
+static uint8_t cardReadBlocks(void* ctx, uint32_t block, uint32_t count, uint8_t* dst) {
+    return readBlocks((sd_card*)ctx, block, count, dst);
+}
+
+static uint8_t cardWriteBlocks(void* ctx, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+    return writeBlocks((sd_card*)ctx, block, count, src, blocking);
+}
+
+static uint8_t cardSync(void* ctx) {
+    return syncCard((sd_card*)ctx);
+}
+
+static uint32_t cardSectorCount(void* ctx) {
+    return cardSize((sd_card*)ctx);
+}
+
+static const block_dev_ops cardOps = {
+    cardReadData,
+    cardReadBlock,
+    cardWriteBlock,
+    cardReadBlocks,
+    cardWriteBlocks,
+    cardSync,
+    cardSectorCount
+};
+
+// Use an initialized card as the block device of a volume.
+void sd_card_block_dev(block_dev* dev, sd_card* card) {
+    dev->ops_ = &cardOps;
+    dev->ctx_ = card;
 }
@@ -1,6 +1,10 @@
 #ifndef __SD_DRIVER_H
 #define __SD_DRIVER_H
 
+#include <pico/stdlib.h>
+#include <hardware/spi.h>
+#include "block_dev.h"
+
 #ifndef TRUE
 #define TRUE 1
 #endif
@@ -8,27 +12,132 @@
 #define FALSE 0
 #endif
 
+// default pins of a card on spi0
 #define PIN_MISO 4
 #define PIN_CS   5
 #define PIN_SCK  2
 #define PIN_MOSI 3
 
-#define chip_select_high() gpio_put(PIN_CS, TRUE)
-#define chip_select_low() gpio_put(PIN_CS, FALSE)
+// default pins of a second card on spi1
+#define PIN1_MISO 12
+#define PIN1_CS   13
+#define PIN1_SCK  10
+#define PIN1_MOSI 11
+
+#define chip_select_high(card) gpio_put((card)->pinCs_, TRUE)
+#define chip_select_low(card) gpio_put((card)->pinCs_, FALSE)
+
+// wait classes for waitLatency()
+/** data token after CMD17 */
+#define SD_WAIT_READ_SINGLE 0
+/** data token of each block of a CMD18 read */
+#define SD_WAIT_READ_MULTIPLE 1
+/** busy while the card programs a written block */
+#define SD_WAIT_WRITE 2
+/** busy before a command is sent */
+#define SD_WAIT_COMMAND 3
+/** number of wait classes */
+#define SD_WAIT_CLASSES 4
+
+/** Observed wait times of one wait class, microseconds */
+typedef struct __SD_LATENCY_PROT
+{
+  uint32_t last;
+  uint32_t min;
+  uint32_t max;
+  uint32_t avg;
+  uint32_t count;
+} sd_latency;
+
+/** State of one SD card on its own SPI bus */
+typedef struct __SD_CARD_PROT
+{
+  spi_inst_t* spi_;
+  uint8_t pinMiso_;
+  uint8_t pinCs_;
+  uint8_t pinSck_;
+  uint8_t pinMosi_;
+  uint8_t type_;
+  uint8_t status_;
+  // a single block read is open
+  uint8_t reading_;
+  uint16_t offset_;
+  uint32_t block_;
+  uint8_t partialBlock_;
+  // a CMD18 multiple block read is in progress
+  uint8_t multiRead_;
+  // a CMD25 multiple block write is in progress
+  uint8_t multiWrite_;
+  // SPI clock negotiated after init, Hz
+  uint32_t sckHz_;
+  // highest clock the card reports in its CSD, Hz
+  uint32_t cardMaxHz_;
+  // clock ceiling, lowered each time errors force a step down, Hz
+  uint32_t sckLimitHz_;
+  // card checks CRCs and data blocks are verified
+  uint8_t crcEnabled_;
+  // data blocks that failed CRC, in either direction
+  uint32_t crcErrors_;
+  // DMA channels used for block transfers, claimed by init_sd_core()
+  int dmaTx_;
+  int dmaRx_;
+  // kind of transfer the DMA engine is running
+  uint8_t dmaPending_;
+  // fill byte clocked out while receiving
+  uint8_t dmaFill_;
+  // discarded bytes received while sending
+  uint8_t dmaSink_;
+  // destination of a pending DMA read
+  uint8_t* dmaDst_;
+  // checksum of a pending DMA write
+  uint16_t dmaCrc_;
+  // observed wait times, indexed by SD_WAIT_*
+  sd_latency latency_[SD_WAIT_CLASSES];
+} sd_card;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
-uint8_t init_sd_core();
-void flush();
-uint8_t cardCommand(uint8_t cmd, uint32_t arg);
-uint8_t cardAcmd(uint8_t cmd, uint32_t arg);
-uint8_t readData(uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst);
-uint8_t waitStartBlock();
-uint8_t waitNotBusy(unsigned int timeoutMillis);
-uint8_t writeData(uint8_t token, const uint8_t* src);
-uint8_t writeBlock(uint32_t blockNumber, const uint8_t* src, uint8_t blocking);
-uint8_t readBlock(uint32_t block, uint8_t* dst);
+void sd_card_config(sd_card* card, spi_inst_t* spi, uint8_t pinMiso,
+                    uint8_t pinCs, uint8_t pinSck, uint8_t pinMosi);
+uint8_t init_sd_core(sd_card* card);
+void flush(sd_card* card);
+uint8_t cardCommand(sd_card* card, uint8_t cmd, uint32_t arg);
+uint8_t cardAcmd(sd_card* card, uint8_t cmd, uint32_t arg);
+uint8_t readData(sd_card* card, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst);
+uint8_t waitStartBlock(sd_card* card);
+uint8_t waitNotBusy(sd_card* card, unsigned int timeoutMillis);
+uint8_t waitLatency(sd_card* card, uint8_t waitClass, sd_latency* latency);
+uint8_t readCSD(sd_card* card, uint8_t* csd);
+uint8_t readCID(sd_card* card, uint8_t* cid);
+uint32_t cardSizeFromCSD(const uint8_t* csd);
+uint32_t cardSize(sd_card* card);
+void sd_card_block_dev(block_dev* dev, sd_card* card);
+uint8_t stepDownClock(sd_card* card);
+uint8_t retryTransfer(sd_card* card, uint8_t attempt);
+uint32_t clockRate(sd_card* card);
+uint32_t cardClockLimit(sd_card* card);
+uint8_t setCrcMode(sd_card* card, uint8_t enable);
+uint8_t crcMode(sd_card* card);
+uint32_t crcErrors(sd_card* card);
+uint8_t syncCard(sd_card* card);
+uint8_t writeData(sd_card* card, uint8_t token, const uint8_t* src);
+uint8_t writeBlock(sd_card* card, uint32_t blockNumber, const uint8_t* src, uint8_t blocking);
+uint8_t readBlock(sd_card* card, uint32_t block, uint8_t* dst);
+uint8_t readBlockStart(sd_card* card, uint32_t block, uint8_t* dst);
+uint8_t writeBlockStart(sd_card* card, uint32_t blockNumber, const uint8_t* src);
+uint8_t transferBusy(sd_card* card);
+uint8_t transferFinish(sd_card* card);
+uint8_t readStart(sd_card* card, uint32_t block);
+uint8_t readNextStart(sd_card* card, uint8_t* dst);
+uint8_t readNext(sd_card* card, uint8_t* dst);
+uint8_t readStop(sd_card* card);
+uint8_t readBlocks(sd_card* card, uint32_t block, uint32_t count, uint8_t* dst);
+uint8_t writeStart(sd_card* card, uint32_t blockNumber, uint32_t count);
+uint8_t writeNextStart(sd_card* card, const uint8_t* src);
+uint8_t writeNextBlock(sd_card* card, const uint8_t* src);
+uint8_t writeStop(sd_card* card, uint8_t blocking);
+uint8_t writeBlocks(sd_card* card, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking);
 #ifdef __cplusplus
 }
 #endif
@@ -1,10 +1,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include "sd_file.h"
-#include "sd_driver.h"
 
-static int16_t _read(sd_file* pfile, void* buf, uint16_t nbyte);
-static uint8_t _cacheFlush(sd_file* pfile);
+static int32_t _read(sd_file* pfile, void* buf, uint32_t nbyte);
+static uint32_t contiguousBlocks(sd_file* pfile, uint32_t block, uint32_t maxBlocks);
+static uint8_t nextCluster(sd_file* pfile, uint32_t index, uint32_t* cluster);
+static uint8_t extentLookup(sd_file* pfile, uint32_t index, uint32_t* cluster);
+static uint8_t isContiguous(sd_file* pfile);
+static void extentRecord(sd_file* pfile, uint32_t index, uint32_t cluster);
+static void extentThin(sd_file* pfile);
+static uint8_t extentNearest(sd_file* pfile, uint32_t index, uint32_t* mapped, uint32_t* cluster);
+static uint8_t dirIndexBuild(sd_file* dirFile);
+static int16_t dirIndexFind(sd_file* dirFile, const uint8_t* dname, const char* name, uint8_t len);
+static void dirIndexInsert(sd_file* dirFile, uint16_t hash, uint32_t block, uint8_t index);
+static uint8_t dirNameEqual(const uint8_t* a, const uint8_t* b);
+static uint8_t openDirCluster(sd_file* dir, sd_volume* vol, uint32_t cluster);
+static uint8_t addClusters(sd_file* pfile, uint32_t count);
+static void dirChanged(sd_file* dirFile);
+static void lfnHexHash(uint8_t* dname, uint16_t h);
+static uint8_t lfnShortTail(const uint8_t* name, const uint8_t* dname, uint8_t basis);
+static int8_t dirShortNameUsed(sd_file* dirFile, const uint8_t* name);
 
 uint8_t openRoot(sd_file* pfile, sd_volume* vol) {
     // error if file is already open
@@ -19,9 +34,8 @@ uint8_t openRoot(sd_file* pfile, sd_volume* vol) {
     } else if (fatType(vol) == 32) {
         pfile->type_ = FAT_FILE_TYPE_ROOT32;
         pfile->firstCluster_ = rootDirStart(vol);
-    if (!chainSize(vol, pfile->firstCluster_, &pfile->fileSize_)) {
-        return false;
-    }
+        // found when a read reaches the end of the chain
+        pfile->fileSize_ = FILE_SIZE_UNKNOWN;
     } else {
         // volume is not initialized or FAT12
         return false;
@@ -37,6 +51,13 @@ uint8_t openRoot(sd_file* pfile, sd_volume* vol) {
     // root has no directory entry
     pfile->dirBlock_ = 0;
     pfile->dirIndex_ = 0;
+    pfile->extents_ = NULL;
+    pfile->extentCount_ = 0;
+    pfile->extentStride_ = 0;
+    pfile->contiguous_ = FILE_CONTIGUOUS_UNKNOWN;
+    pfile->dirSlots_ = NULL;
+    pfile->dirIndexState_ = DIR_INDEX_EMPTY;
+    pfile->dirChanges_ = vol->dirChanges_;
     return true;
 }
 
@@ -95,48 +116,16 @@ dir_t* readDirCache(sd_file* dirFile) {
     dirFile->curPosition_ += 31;
     
     // return pointer to entry
-    return (dirFile->vol_->cacheBuffer_.dir + i);
+    return (dirFile->vol_->cacheBuffer_->dir + i);
 }
 
 uint8_t fat_seekSet(sd_file* pfile, uint32_t pos) {
-  // error if file not open or seek past end of file
-  if (!isOpen(pfile) || pos > pfile->fileSize_) {
-    return false;
-  }
-
-  if (pfile->type_ == FAT_FILE_TYPE_ROOT16) {
-    pfile->curPosition_ = pos;
-    return true;
-  }
-  if (pos == 0) {
-    // set position to start of file
-    pfile->curCluster_ = 0;
-    pfile->curPosition_ = 0;
-    return true;
-  }
-  // calculate cluster index for cur and new position
-  uint32_t nCur = (pfile->curPosition_ - 1) >> (pfile->vol_->clusterSizeShift_ + 9);
-  uint32_t nNew = (pos - 1) >> (pfile->vol_->clusterSizeShift_ + 9);
-
-  if (nNew < nCur || pfile->curPosition_ == 0) {
-    // must follow chain from first cluster
-    pfile->curCluster_ = pfile->firstCluster_;
-  } else {
-    // advance from curPosition
-    nNew -= nCur;
-  }
-  while (nNew--) {
-    if (!fatGet(pfile->vol_, pfile->curCluster_, &pfile->curCluster_)) {
-      return false;
-    }
-  }
-  pfile->curPosition_ = pos;
-  return true;
+  return seekSet(pfile, pos);
 }
 
 uint8_t fat_openCachedEntry(sd_file* pfile, uint8_t dirIndex, uint8_t oflag) {
     // location of entry in cache
-    dir_t* p = pfile->vol_->cacheBuffer_.dir + dirIndex;
+    dir_t* p = pfile->vol_->cacheBuffer_->dir + dirIndex;
 
     // write or truncate is an error for a directory or read-only file
     if (p->attributes & (DIR_ATT_READ_ONLY | DIR_ATT_DIRECTORY)) {
@@ -157,9 +146,7 @@ uint8_t fat_openCachedEntry(sd_file* pfile, uint8_t dirIndex, uint8_t oflag) {
     pfile->fileSize_ = p->fileSize;
     pfile->type_ = FAT_FILE_TYPE_NORMAL;
     } else if (DIR_IS_SUBDIR(p)) {
-    if (!chainSize(pfile->vol_, pfile->firstCluster_, &pfile->fileSize_)) {
-        return false;
-    }
+    pfile->fileSize_ = FILE_SIZE_UNKNOWN;
     pfile->type_ = FAT_FILE_TYPE_SUBDIR;
     } else {
     return false;
@@ -170,6 +157,13 @@ uint8_t fat_openCachedEntry(sd_file* pfile, uint8_t dirIndex, uint8_t oflag) {
     // set to start of file
     pfile->curCluster_ = 0;
     pfile->curPosition_ = 0;
+    pfile->extents_ = NULL;
+    pfile->extentCount_ = 0;
+    pfile->extentStride_ = 0;
+    pfile->contiguous_ = FILE_CONTIGUOUS_UNKNOWN;
+    pfile->dirSlots_ = NULL;
+    pfile->dirIndexState_ = DIR_INDEX_EMPTY;
+    pfile->dirChanges_ = pfile->vol_->dirChanges_;
 
     // truncate file to zero length if requested
     if (oflag & O_TRUNC) {
@@ -187,26 +181,146 @@ int16_t sd_read(sd_file* pfile) {
     return _read(pfile, &b, 1) == 1 ? b : -1;
 }
 
-// free a cluster chain
-uint8_t freeChain(sd_file* pfile, uint32_t cluster) {
-  // clear free cluster location
-//   pfile->allocSearchStart_ = 2;
+// Read up to nbyte bytes into buf. Whole blocks go from the device
+// straight to buf, several with one multi-block read when they follow
+// each other. Reads at most 0X7FFFFFFF bytes per call. Returns the
+// bytes read, zero at end of file or -1.
+int32_t sd_read_buf(sd_file* pfile, void* buf, uint32_t nbyte) {
+    return _read(pfile, buf, nbyte);
+}
 
-  do {
-    uint32_t next;
-    if (!fatGet(pfile->vol_, cluster, &next)) {
-      return false;
+// Write nbyte bytes from buf at the current position. Whole blocks not
+// in the cache go straight to the device, several with one multi-block
+// write when they follow each other, partial blocks are merged in the
+// cache. The chain grows by up to SD_WRITE_CLUSTER_BATCH clusters at a
+// time. The directory entry is updated by sync(). Returns nbyte or -1.
+int32_t sd_write(sd_file* pfile, const void* buf, uint32_t nbyte) {
+  const uint8_t* src = (const uint8_t*)buf;
+  sd_volume* vol = pfile->vol_;
+  uint8_t blocking = !(pfile->flags_ & F_FILE_NON_BLOCKING_WRITE);
+
+  // error if not a normal file or read only
+  if (!isFile(pfile) || !(pfile->flags_ & O_WRITE)) {
+    return -1;
+  }
+
+  // seek to end of file if append flag
+  if ((pfile->flags_ & O_APPEND) && pfile->curPosition_ != pfile->fileSize_) {
+    if (!seekSet(pfile, pfile->fileSize_)) {
+      return -1;
     }
+  }
 
-    // free cluster
-    if (!fatPut(pfile->vol_, cluster, 0)) {
-      return false;
+  // max file size is 4 GB - 1
+  if (nbyte > FILE_SIZE_UNKNOWN - pfile->curPosition_) {
+    return -1;
+  }
+
+  // clusters added past the old size break the contiguous fast path
+  uint8_t grows = pfile->curPosition_ + nbyte > pfile->fileSize_;
+  if (grows) {
+    pfile->contiguous_ = FILE_CONTIGUOUS_NO;
+  }
+
+  // amount left to write
+  uint32_t toWrite = nbyte;
+  while (toWrite > 0) {
+    uint8_t _blockOfCluster = blockOfCluster(pfile, pfile->curPosition_);
+    uint16_t offset = pfile->curPosition_ & 0X1FF;  // offset in block
+    if (offset == 0 && _blockOfCluster == 0) {
+      // start of new cluster
+      uint32_t index = pfile->curPosition_ >> (vol->clusterSizeShift_ + 9);
+      uint32_t next;
+      if (pfile->curPosition_ == 0) {
+        // use first cluster in file, zero if it has none
+        next = pfile->firstCluster_;
+        pfile->curCluster_ = 0;
+      } else {
+        next = pfile->curCluster_;
+        if (!nextCluster(pfile, index, &next)) {
+          return -1;
+        }
+        if (isEOC(vol, next)) {
+          next = 0;
+        }
+      }
+      if (next) {
+        pfile->curCluster_ = next;
+      } else {
+        // end of chain - allocate clusters for the rest of the data
+        uint32_t count = (toWrite + (512UL << vol->clusterSizeShift_) - 1) >>
+                         (vol->clusterSizeShift_ + 9);
+        if (count > SD_WRITE_CLUSTER_BATCH) {
+          count = SD_WRITE_CLUSTER_BATCH;
+        }
+        if (!addClusters(pfile, count)) {
+          return -1;
+        }
+      }
+      extentRecord(pfile, index, pfile->curCluster_);
     }
+    uint32_t block = clusterStartBlock(pfile, pfile->curCluster_) + _blockOfCluster;
 
-    cluster = next;
-  } while (!isEOC(pfile->vol_, cluster));
+    // amount to be written to current block
+    uint16_t n = toWrite > 512U - offset ? 512U - offset : toWrite;
 
-  return true;
+    // several whole blocks to write - stream them with one CMD25
+    if (offset == 0 && toWrite >= 1024 && cacheUncachedRun(vol, block, 1)) {
+      uint32_t count = contiguousBlocks(pfile, block, toWrite >> 9);
+      if (count == 0) {
+        return -1;
+      }
+      if (count > 1) {
+        if (!devWriteBlocks(vol, block, count, src, blocking)) {
+          return -1;
+        }
+        src += count << 9;
+        pfile->curPosition_ += count << 9;
+        toWrite -= count << 9;
+        continue;
+      }
+    }
+
+    if (n == 512 && cacheUncachedRun(vol, block, 1)) {
+      // whole block not in the cache - no buffering needed
+      if (!devWriteBlock(vol, block, src, blocking)) {
+        return -1;
+      }
+    } else {
+      if (offset == 0 && pfile->curPosition_ >= pfile->fileSize_) {
+        // start of a block past the end of file - nothing to read
+        if (!cacheClaimBlock(vol, block)) {
+          return -1;
+        }
+      } else if (!cacheRawBlock(vol, block, CACHE_FOR_WRITE)) {
+        return -1;
+      }
+      memcpy(vol->cacheBuffer_->data + offset, src, n);
+      cacheSetDirty(vol);
+    }
+    src += n;
+    pfile->curPosition_ += n;
+    toWrite -= n;
+  }
+
+  if (pfile->curPosition_ > pfile->fileSize_) {
+    // update file size and directory entry at the next sync
+    pfile->fileSize_ = pfile->curPosition_;
+    pfile->flags_ |= F_FILE_DIR_DIRTY;
+  }
+  if (grows) {
+    pfile->contiguous_ = FILE_CONTIGUOUS_UNKNOWN;
+  }
+  if ((pfile->flags_ & O_SYNC) && !sync(pfile, blocking)) {
+    return -1;
+  }
+  return nbyte;
+}
+
+// free a cluster chain
+uint8_t freeChain(sd_file* pfile, uint32_t cluster) {
+  // the volume search start moves back to freed clusters
+  return fatFreeRun(pfile->vol_, cluster);
 }
 
 uint8_t truncate(sd_file* pfile, uint32_t length) {
@@ -220,8 +334,9 @@ uint8_t truncate(sd_file* pfile, uint32_t length) {
     return false;
   }
 
-  // fileSize and length are zero - nothing to do
-  if (pfile->fileSize_ == 0) {
+  // no clusters - nothing to do, a failed write may leave some on an
+  // empty file
+  if (pfile->fileSize_ == 0 && pfile->firstCluster_ == 0) {
     return true;
   }
 
@@ -258,6 +373,20 @@ uint8_t truncate(sd_file* pfile, uint32_t length) {
     }
   }
   pfile->fileSize_ = length;
+  pfile->contiguous_ = FILE_CONTIGUOUS_UNKNOWN;
+
+  // drop freed clusters from the extent map
+  uint32_t clusters = (length + (512UL << pfile->vol_->clusterSizeShift_) - 1) >>
+                      (pfile->vol_->clusterSizeShift_ + 9);
+  while (pfile->extentCount_ && pfile->extents_[pfile->extentCount_ - 1].fileCluster_ >= clusters) {
+    pfile->extentCount_--;
+  }
+  if (pfile->extentCount_) {
+    sd_extent* last = &pfile->extents_[pfile->extentCount_ - 1];
+    if (last->fileCluster_ + last->length_ > clusters) {
+      last->length_ = clusters - last->fileCluster_;
+    }
+  }
 
   // need to update directory entry
   pfile->flags_ |= F_FILE_DIR_DIRTY;
@@ -294,15 +423,41 @@ uint8_t seekSet(sd_file* pfile, uint32_t pos) {
   uint32_t nCur = (pfile->curPosition_ - 1) >> (pfile->vol_->clusterSizeShift_ + 9);
   uint32_t nNew = (pos - 1) >> (pfile->vol_->clusterSizeShift_ + 9);
 
+  if (isContiguous(pfile)) {
+    // no gaps - the cluster follows from the first one
+    pfile->curCluster_ = pfile->firstCluster_ + nNew;
+    pfile->curPosition_ = pos;
+    return true;
+  }
+  if (pfile->extentCount_ && extentLookup(pfile, nNew, &pfile->curCluster_)) {
+    // mapped - no FAT access
+    pfile->curPosition_ = pos;
+    return true;
+  }
   if (nNew < nCur || pfile->curPosition_ == 0) {
     // must follow chain from first cluster
     pfile->curCluster_ = pfile->firstCluster_;
-  } else {
-    // advance from curPosition
-    nNew -= nCur;
+    nCur = 0;
+    extentRecord(pfile, 0, pfile->firstCluster_);
+  }
+  // continue from the nearest mapped cluster before nNew if that is closer
+  uint32_t mapped;
+  uint32_t mappedCluster;
+  if (extentNearest(pfile, nNew, &mapped, &mappedCluster) && mapped > nCur) {
+    nCur = mapped;
+    pfile->curCluster_ = mappedCluster;
   }
-  while (nNew--) {
-    if (!fatGet(pfile->vol_, pfile->curCluster_, &pfile->curCluster_)) {
+  while (nCur < nNew) {
+    if (!nextCluster(pfile, ++nCur, &pfile->curCluster_)) {
+      return false;
+    }
+    if (isEOC(pfile->vol_, pfile->curCluster_)) {
+      if (isDir(pfile)) {
+        // seek past the end of a directory, its size is now known
+        pfile->fileSize_ = nCur << (pfile->vol_->clusterSizeShift_ + 9);
+        rewind(pfile);
+      }
+      // a file chain shorter than its size is an error
       return false;
     }
   }
@@ -310,6 +465,186 @@ uint8_t seekSet(sd_file* pfile, uint32_t pos) {
   return true;
 }
 
+// Use extents to remember where the clusters of the file are. The map
+// is filled as the chain is walked by reads and seeks. A file with more
+// fragments than capacity keeps evenly spaced extents as checkpoints,
+// seeks between them walk the FAT from the one before.
+void setExtentMap(sd_file* pfile, sd_extent* extents, uint16_t capacity) {
+  pfile->extents_ = capacity ? extents : NULL;
+  pfile->extentCapacity_ = capacity;
+  pfile->extentCount_ = 0;
+  pfile->extentStride_ = 0;
+}
+
+// Add cluster at file cluster index to the map if it extends the
+// mapped part of the chain.
+static void extentRecord(sd_file* pfile, uint32_t index, uint32_t cluster) {
+  if (!pfile->extents_) {
+    return;
+  }
+  if (pfile->extentCount_ == 0) {
+    if (index == 0 && cluster) {
+      pfile->extents_[0].fileCluster_ = 0;
+      pfile->extents_[0].diskCluster_ = cluster;
+      pfile->extents_[0].length_ = 1;
+      pfile->extentCount_ = 1;
+    }
+    return;
+  }
+  sd_extent* last = &pfile->extents_[pfile->extentCount_ - 1];
+  if (index != last->fileCluster_ + last->length_) {
+    return;
+  }
+  if (cluster == last->diskCluster_ + last->length_) {
+    last->length_++;
+  } else {
+    if (pfile->extentCount_ > 1 &&
+        last->fileCluster_ - last[-1].fileCluster_ < pfile->extentStride_) {
+      // last extent is too close to the checkpoint before it, reuse it
+      last->fileCluster_ = index;
+      last->diskCluster_ = cluster;
+      last->length_ = 1;
+      return;
+    }
+    if (pfile->extentCount_ == pfile->extentCapacity_) {
+      extentThin(pfile);
+      if (pfile->extentCount_ == pfile->extentCapacity_) {
+        return;
+      }
+    }
+    last = &pfile->extents_[pfile->extentCount_];
+    last->fileCluster_ = index;
+    last->diskCluster_ = cluster;
+    last->length_ = 1;
+    pfile->extentCount_++;
+  }
+}
+
+// Make room in a full map. Extents are kept as checkpoints at least
+// extentStride_ file clusters apart, the stride is raised so about half
+// of the map stays. The last extent, where the walk of the chain goes
+// on, is always kept.
+static void extentThin(sd_file* pfile) {
+  if (pfile->extentCount_ < 3) {
+    return;
+  }
+  sd_extent* last = &pfile->extents_[pfile->extentCount_ - 1];
+  uint32_t stride = (last->fileCluster_ + last->length_) / (pfile->extentCapacity_ / 2 + 1) + 1;
+  if (stride <= pfile->extentStride_) {
+    stride = 2 * pfile->extentStride_;
+  }
+  uint16_t n = 1;
+  for (uint16_t i = 1; i + 1 < pfile->extentCount_; i++) {
+    if (pfile->extents_[i].fileCluster_ - pfile->extents_[n - 1].fileCluster_ >= stride) {
+      pfile->extents_[n++] = pfile->extents_[i];
+    }
+  }
+  pfile->extents_[n++] = *last;
+  pfile->extentCount_ = n;
+  pfile->extentStride_ = stride;
+}
+
+// Last mapped cluster at or before file cluster index, in *mapped and
+// its device cluster in *cluster. False if the map has none.
+static uint8_t extentNearest(sd_file* pfile, uint32_t index, uint32_t* mapped, uint32_t* cluster) {
+  uint16_t lo = 0;
+  uint16_t hi = pfile->extentCount_;
+  // find the first extent that starts after index
+  while (lo < hi) {
+    uint16_t mid = (lo + hi) / 2;
+    if (index < pfile->extents_[mid].fileCluster_) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  if (lo == 0) {
+    return false;
+  }
+  sd_extent* e = &pfile->extents_[lo - 1];
+  uint32_t offset = index - e->fileCluster_;
+  if (offset >= e->length_) {
+    offset = e->length_ - 1;
+  }
+  *mapped = e->fileCluster_ + offset;
+  *cluster = e->diskCluster_ + offset;
+  return true;
+}
+
+// Cluster at file cluster index from the map, binary search.
+static uint8_t extentLookup(sd_file* pfile, uint32_t index, uint32_t* cluster) {
+  uint16_t lo = 0;
+  uint16_t hi = pfile->extentCount_;
+  // quick reject past the mapped part of the chain
+  if (hi == 0 || index >= pfile->extents_[hi - 1].fileCluster_ + pfile->extents_[hi - 1].length_) {
+    return false;
+  }
+  while (lo < hi) {
+    uint16_t mid = (lo + hi) / 2;
+    sd_extent* e = &pfile->extents_[mid];
+    if (index < e->fileCluster_) {
+      hi = mid;
+    } else if (index - e->fileCluster_ >= e->length_) {
+      lo = mid + 1;
+    } else {
+      *cluster = e->diskCluster_ + index - e->fileCluster_;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Check once whether the clusters holding the file are one run on the
+// device. A FAT error is treated as a gap so the normal path reports it.
+static uint8_t isContiguous(sd_file* pfile) {
+  if (pfile->fileSize_ == FILE_SIZE_UNKNOWN) {
+    // directory not read to its end, follow the chain
+    return false;
+  }
+  if (pfile->contiguous_ == FILE_CONTIGUOUS_UNKNOWN) {
+    uint8_t shift = pfile->vol_->clusterSizeShift_ + 9;
+    uint32_t clusters = (pfile->fileSize_ + (1UL << shift) - 1) >> shift;
+    uint32_t cluster = pfile->firstCluster_;
+    pfile->contiguous_ = FILE_CONTIGUOUS_YES;
+    for (uint32_t i = 1; i < clusters && pfile->contiguous_ == FILE_CONTIGUOUS_YES; ) {
+      uint32_t next[16];
+      uint32_t n;
+      if (!fatReadChainBatch(pfile->vol_, cluster, next,
+                             clusters - i < 16 ? clusters - i : 16, &n)) {
+        pfile->contiguous_ = FILE_CONTIGUOUS_NO;
+        break;
+      }
+      for (uint32_t k = 0; k < n; k++, i++) {
+        if (next[k] != cluster + 1) {
+          pfile->contiguous_ = FILE_CONTIGUOUS_NO;
+          break;
+        }
+        cluster = next[k];
+      }
+    }
+  }
+  return pfile->contiguous_ == FILE_CONTIGUOUS_YES;
+}
+
+// Cluster at file cluster index, the successor of cluster index - 1 in
+// *cluster. Contiguous files and mapped clusters need no FAT access.
+static uint8_t nextCluster(sd_file* pfile, uint32_t index, uint32_t* cluster) {
+  if (isContiguous(pfile)) {
+    *cluster = pfile->firstCluster_ + index;
+    return true;
+  }
+  if (extentLookup(pfile, index, cluster)) {
+    return true;
+  }
+  if (!fatGet(pfile->vol_, *cluster, cluster)) {
+    return false;
+  }
+  if (!isEOC(pfile->vol_, *cluster)) {
+    extentRecord(pfile, index, *cluster);
+  }
+  return true;
+}
+
 uint8_t sync(sd_file* pfile, uint8_t blocking) {
   // only allow open files and directories
   if (!isOpen(pfile)) {
@@ -341,10 +676,6 @@ uint8_t sync(sd_file* pfile, uint8_t blocking) {
     pfile->flags_ &= ~F_FILE_DIR_DIRTY;
   }
 
-  if (!blocking) {
-    pfile->flags_ &= ~F_FILE_NON_BLOCKING_WRITE;
-  }
-
   return cacheFlush(pfile->vol_, blocking);
 }
 
@@ -366,11 +697,11 @@ dir_t* cacheDirEntry(sd_file* pfile, uint8_t action) {
   if (!cacheRawBlock(pfile->vol_, pfile->dirBlock_, action)) {
     return NULL;
   }
-  return (dir_t*)(pfile->vol_->cacheBuffer_.dir + pfile->dirIndex_);
+  return (dir_t*)(pfile->vol_->cacheBuffer_->dir + pfile->dirIndex_);
 }
 
 
-static int16_t _read(sd_file* pfile, void* buf, uint16_t nbyte) {
+static int32_t _read(sd_file* pfile, void* buf, uint32_t nbyte) {
   uint8_t* dst = (uint8_t*)(buf);
 
   // error if not open or write only
@@ -378,13 +709,17 @@ static int16_t _read(sd_file* pfile, void* buf, uint16_t nbyte) {
     return -1;
   }
 
+  // the count is returned as int32_t
+  if (nbyte > 0X7FFFFFFF) {
+    nbyte = 0X7FFFFFFF;
+  }
   // max bytes left in file
   if (nbyte > (pfile->fileSize_ - pfile->curPosition_)) {
     nbyte = pfile->fileSize_ - pfile->curPosition_;
   }
 
   // amount left to read
-  uint16_t toRead = nbyte;
+  uint32_t toRead = nbyte;
   while (toRead > 0) {
     uint32_t block;  // raw device block number
     uint16_t offset = pfile->curPosition_ & 0X1FF;  // offset in block
@@ -397,26 +732,52 @@ static int16_t _read(sd_file* pfile, void* buf, uint16_t nbyte) {
         if (pfile->curPosition_ == 0) {
           // use first cluster in file
           pfile->curCluster_ = pfile->firstCluster_;
+          extentRecord(pfile, 0, pfile->firstCluster_);
         } else {
-          // get next cluster from FAT
-          if (!fatGet(pfile->vol_, pfile->curCluster_, &pfile->curCluster_)) {
+          // get next cluster from the extent map or FAT
+          uint32_t index = pfile->curPosition_ >> (pfile->vol_->clusterSizeShift_ + 9);
+          uint32_t prev = pfile->curCluster_;
+          if (!nextCluster(pfile, index, &pfile->curCluster_)) {
             return -1;
           }
+          if (isEOC(pfile->vol_, pfile->curCluster_)) {
+            pfile->curCluster_ = prev;
+            if (!isDir(pfile)) {
+              // file chain shorter than its size
+              return -1;
+            }
+            // end of a directory chain, its size is now known
+            pfile->fileSize_ = pfile->curPosition_;
+            return nbyte - toRead;
+          }
         }
       }
       block = clusterStartBlock(pfile, pfile->curCluster_) + _blockOfCluster;
     }
-    uint16_t n = toRead;
-
     // amount to be read from current block
-    if (n > (512 - offset)) {
-      n = 512 - offset;
+    uint16_t n = toRead > 512U - offset ? 512U - offset : toRead;
+
+    // several whole blocks requested - stream them with one CMD18
+    if (offset == 0 && toRead >= 1024 && cacheUncachedRun(pfile->vol_, block, 1)) {
+      uint32_t count = contiguousBlocks(pfile, block, toRead >> 9);
+      if (count == 0) {
+        return -1;
+      }
+      if (count > 1) {
+        if (!devReadBlocks(pfile->vol_, block, count, dst)) {
+          return -1;
+        }
+        dst += count << 9;
+        pfile->curPosition_ += count << 9;
+        toRead -= count << 9;
+        continue;
+      }
     }
 
     // no buffering needed if n == 512 or user requests no buffering
     if ((unbufferedRead(pfile) || n == 512) &&
-        block != pfile->vol_->cacheBlockNumber_) {
-      if (!readData(block, offset, n, dst)) {
+        cacheUncachedRun(pfile->vol_, block, 1)) {
+      if (!devReadData(pfile->vol_, block, offset, n, dst)) {
         return -1;
       }
       dst += n;
@@ -425,11 +786,8 @@ static int16_t _read(sd_file* pfile, void* buf, uint16_t nbyte) {
       if (!cacheRawBlock(pfile->vol_, block, CACHE_FOR_READ)) {
         return -1;
       }
-      uint8_t* src = pfile->vol_->cacheBuffer_.data + offset;
-      uint8_t* end = src + n;
-      while (src != end) {
-        *dst++ = *src++;
-      }
+      memcpy(dst, pfile->vol_->cacheBuffer_->data + offset, n);
+      dst += n;
     }
     pfile->curPosition_ += n;
     toRead -= n;
@@ -437,6 +795,42 @@ static int16_t _read(sd_file* pfile, void* buf, uint16_t nbyte) {
   return nbyte;
 }
 
+// Count the blocks, up to maxBlocks, that follow block on the device
+// without a gap, starting at the current position. Contiguous clusters
+// are merged into the run and curCluster_ is left on the last cluster
+// of the run. A cached block ends the run so its data is not bypassed.
+// Returns zero on a FAT error.
+static uint32_t contiguousBlocks(sd_file* pfile, uint32_t block, uint32_t maxBlocks) {
+  maxBlocks = cacheUncachedRun(pfile->vol_, block, maxBlocks);
+  uint32_t count;
+  if (pfile->type_ == FAT_FILE_TYPE_ROOT16) {
+    count = maxBlocks;
+  } else if (isContiguous(pfile)) {
+    // whole file is one run, leave curCluster_ on its last cluster
+    count = maxBlocks;
+    pfile->curCluster_ = pfile->firstCluster_ +
+        (((pfile->curPosition_ >> 9) + count - 1) >> pfile->vol_->clusterSizeShift_);
+  } else {
+    count = pfile->vol_->blocksPerCluster_ - blockOfCluster(pfile, pfile->curPosition_);
+    while (count < maxBlocks) {
+      uint32_t index = ((pfile->curPosition_ >> 9) + count) >> pfile->vol_->clusterSizeShift_;
+      uint32_t next = pfile->curCluster_;
+      if (!nextCluster(pfile, index, &next)) {
+        return 0;
+      }
+      if (next != pfile->curCluster_ + 1) {
+        break;
+      }
+      pfile->curCluster_ = next;
+      count += pfile->vol_->blocksPerCluster_;
+    }
+    if (count > maxBlocks) {
+      count = maxBlocks;
+    }
+  }
+  return count;
+}
+
 uint8_t blockOfCluster(sd_file* pfile, uint32_t position) {
     return (position >> 9) & (pfile->vol_->blocksPerCluster_ - 1);
 }
@@ -453,9 +847,415 @@ uint8_t unbufferedRead(sd_file* pfile) {
     return pfile->flags_ & F_FILE_UNBUFFERED_READ;
 }
 
+// Let writes return before the card finishes programming a block or
+// the last block of a multi-block run. The next command waits for it.
+void setNonBlockingWrite(sd_file* pfile, uint8_t enable) {
+    if (enable) {
+        pfile->flags_ |= F_FILE_NON_BLOCKING_WRITE;
+    } else {
+        pfile->flags_ &= ~F_FILE_NON_BLOCKING_WRITE;
+    }
+}
+
+// Read the next block of a directory and point *entries at its 16
+// entries in the cache, or at NULL past the end of the directory. A
+// partly read block is skipped. Bit i of *valid is set for each entry
+// that filter does not remove. Returns the number of entries before
+// the first free one, no entries in use follow a free entry, or -1 on
+// an error. The entries stay valid until the next cache access.
+int8_t sd_readdir(sd_file* dirFile, dir_t** entries, uint16_t* valid, uint8_t filter) {
+  *entries = NULL;
+  *valid = 0;
+  dirFile->curPosition_ = (dirFile->curPosition_ + 511) & ~511UL;
+  if (dirFile->curPosition_ >= dirFile->fileSize_) {
+    return 0;
+  }
+  // one read to locate and cache the block
+  dir_t* p = readDirCache(dirFile);
+  if (p == NULL) {
+    // the read may have found the end of the directory chain
+    return dirFile->curPosition_ == dirFile->fileSize_ ? 0 : -1;
+  }
+  dirFile->curPosition_ += 480;
+
+  uint16_t bits = 0;
+  uint8_t n;
+  for (n = 0; n < 16; n++) {
+    uint8_t c = p[n].name[0];
+    if (c == DIR_NAME_FREE) {
+      break;
+    }
+    if (c == DIR_NAME_DELETED) {
+      if (filter & READDIR_SKIP_DELETED) {
+        continue;
+      }
+    } else if (DIR_IS_LONG_NAME(p + n) && (filter & READDIR_SKIP_LONG_NAME)) {
+      continue;
+    }
+    bits |= 1U << n;
+  }
+  *entries = p;
+  *valid = bits;
+  return n;
+}
+
+// Compare two 8.3 names a word at a time.
+static uint8_t dirNameEqual(const uint8_t* a, const uint8_t* b) {
+  uint32_t wa[3];
+  uint32_t wb[3];
+  wa[2] = wb[2] = 0;
+  memcpy(wa, a, 11);
+  memcpy(wb, b, 11);
+  return ((wa[0] ^ wb[0]) | (wa[1] ^ wb[1]) | (wa[2] ^ wb[2])) == 0;
+}
+
+// Use slots to index the names of a directory. The index is built by
+// the next sd_open() and kept up to date by files it creates. It is
+// built again after an entry is created through another handle.
+void setDirIndex(sd_file* dirFile, sd_dir_slot* slots, uint16_t capacity) {
+  dirFile->dirSlots_ = capacity ? slots : NULL;
+  dirFile->dirSlotCapacity_ = capacity;
+  dirFile->dirIndexState_ = DIR_INDEX_EMPTY;
+}
+
+static uint16_t dirNameHash(const uint8_t* name) {
+  // FNV-1a folded to 16 bits, zero marks a free slot
+  uint32_t h = 2166136261UL;
+  for (uint8_t i = 0; i < 11; i++) {
+    h ^= name[i];
+    h *= 16777619UL;
+  }
+  h = (h >> 16) ^ (h & 0XFFFF);
+  return h ? h : 1;
+}
+
+// Offsets of the UTF-16 characters in a long name entry.
+static const uint8_t lfnCharOffset[LDIR_NAME_CHARS] = {
+  1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+};
+
+static uint16_t lfnGetChar(const dir_t* d, uint8_t i) {
+  const uint8_t* p = (const uint8_t*)d + lfnCharOffset[i];
+  return p[0] | (p[1] << 8);
+}
+
+static void lfnPutChar(dir_t* d, uint8_t i, uint16_t c) {
+  uint8_t* p = (uint8_t*)d + lfnCharOffset[i];
+  p[0] = c;
+  p[1] = c >> 8;
+}
+
+// Long names are compared without regard to ASCII case.
+static uint16_t lfnFold(uint16_t c) {
+  return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+}
+
+// Checksum of a short name, kept in the long name entries before it.
+static uint8_t lfnChecksum(const uint8_t* name) {
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < 11; i++) {
+    sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+  }
+  return sum;
+}
+
+// Hash of the character at pos of a long name. A name hashes to the sum
+// for its characters so it can be hashed from its entries, which are
+// stored last part first.
+static uint32_t lfnHashChar(uint16_t c, uint16_t pos) {
+  uint32_t h = ((lfnFold(c) + 1) * 0X9E3779B1UL) ^ ((pos + 1) * 0X85EBCA77UL);
+  h ^= h >> 15;
+  h *= 0X2C1B3C6DUL;
+  return h ^ (h >> 12);
+}
+
+static uint32_t lfnHashSum(const char* name, uint8_t len) {
+  uint32_t h = 0;
+  for (uint8_t i = 0; i < len; i++) {
+    h += lfnHashChar((uint8_t)name[i], i);
+  }
+  return h;
+}
+
+// Index slot hash of a long name from its character sum.
+static uint16_t lfnSlotHash(uint32_t h, uint8_t len) {
+  h += len * 0XC2B2AE35UL;
+  h = (h >> 16) ^ (h & 0XFFFF);
+  return h ? h : 1;
+}
+
+// A name sd_open() can store as a long name. Only printable ASCII is
+// taken, it is stored as UTF-16.
+static uint8_t lfnValidName(const char* name, size_t len) {
+  if (len == 0 || len > LFN_NAME_MAX || name[len - 1] == ' ' || name[len - 1] == '.') {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = name[i];
+    if (c < 0X20 || c > 0X7E || strchr("\"*/:<>?\\|", c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Check part ord, counted from one, of a long name entry against the
+// same part of name.
+static uint8_t lfnMatchPart(const dir_t* d, const char* name, uint8_t len, uint8_t ord) {
+  uint16_t pos = (ord - 1) * LDIR_NAME_CHARS;
+  for (uint8_t i = 0; i < LDIR_NAME_CHARS && pos <= len; i++, pos++) {
+    uint16_t c = lfnGetChar(d, i);
+    if (pos == len ? c != 0 : lfnFold(c) != lfnFold((uint8_t)name[pos])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Check that the long name entries before the short entry at index of
+// block spell name. Returns 1 if they do, 0 if not, -1 if they start
+// before the cluster of block and -2 on a read error.
+static int8_t lfnVerify(sd_file* dirFile, uint32_t block, uint8_t index, const char* name, uint8_t len) {
+  sd_volume* vol = dirFile->vol_;
+  if (!cacheRawBlock(vol, block, CACHE_FOR_READ)) {
+    return -2;
+  }
+  uint8_t chk = lfnChecksum(vol->cacheBuffer_->dir[index].name);
+  uint8_t count = (len + LDIR_NAME_CHARS - 1) / LDIR_NAME_CHARS;
+  for (uint8_t ord = 1; ord <= count; ord++) {
+    if (index == 0) {
+      // the name goes on in the block before if it is in the same cluster
+      uint32_t first = dirFile->type_ == FAT_FILE_TYPE_ROOT16 ? rootDirStart(vol) :
+          block - ((block - vol->dataStartBlock_) & (vol->blocksPerCluster_ - 1));
+      if (block == first) {
+        return -1;
+      }
+      block--;
+      index = 16;
+      if (!cacheRawBlock(vol, block, CACHE_FOR_READ)) {
+        return -2;
+      }
+    }
+    dir_t* d = vol->cacheBuffer_->dir + --index;
+    uint8_t want = ord == count ? ord | LDIR_ORD_LAST_LONG_ENTRY : ord;
+    if (!DIR_IS_LONG_NAME(d) || d->name[0] != want || ((ldir_t*)d)->chksum != chk ||
+        !lfnMatchPart(d, name, len, ord)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Start of the short name for a new long name: the characters an 8.3
+// name can hold, six of the name and three of the extension. Returns
+// the length of the name part, the numeric tail goes after it.
+static uint8_t lfnShortBasis(const char* name, uint8_t len, uint8_t* dname) {
+  uint8_t dot = len;
+  uint8_t b = 0;
+  memset(dname, ' ', 11);
+  for (uint8_t i = len - 1; i > 0; i--) {
+    if (name[i] == '.') {
+      dot = i;
+      break;
+    }
+  }
+  for (uint8_t i = 0; i < len; i++) {
+    uint8_t c = name[i];
+    if (c == ' ' || c == '.') {
+      continue;
+    }
+    if (c >= 'a' && c <= 'z') {
+      c -= 'a' - 'A';
+    } else if (strchr("+,;=[]", c)) {
+      c = '_';
+    }
+    if (i < dot && b < 6) {
+      dname[b++] = c;
+    } else if (i > dot && dname[10] == ' ') {
+      // next free place in the extension
+      uint8_t e = 8;
+      while (dname[e] != ' ') {
+        e++;
+      }
+      dname[e] = c;
+    }
+  }
+  if (b == 0) {
+    dname[b++] = '_';
+  }
+  return b;
+}
+
+// Hashed short name: four hex digits of h after the first two
+// characters, then the tail ~1.
+static void lfnHexHash(uint8_t* dname, uint16_t h) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (uint8_t i = 0; i < 4; i++) {
+    dname[2 + i] = hex[(h >> (12 - 4 * i)) & 0XF];
+  }
+  dname[6] = '~';
+  dname[7] = '1';
+}
+
+// Numeric tail 1 to 9 of name if it is the first basis characters of
+// dname, '~', the digit and the rest of dname, or zero.
+static uint8_t lfnShortTail(const uint8_t* name, const uint8_t* dname, uint8_t basis) {
+  if (!memcmp(name, dname, basis) && name[basis] == '~' &&
+      name[basis + 1] > '0' && name[basis + 1] <= '9' &&
+      !memcmp(name + basis + 2, dname + basis + 2, 9 - basis)) {
+    return name[basis + 1] - '0';
+  }
+  return 0;
+}
+
+// Look for an entry with the short name name in dirFile. Returns 1 if
+// there is one, 0 if not and -1 on a read error.
+static int8_t dirShortNameUsed(sd_file* dirFile, const uint8_t* name) {
+  rewind(dirFile);
+  int8_t n;
+  do {
+    dir_t* p;
+    uint16_t valid;
+    n = sd_readdir(dirFile, &p, &valid, READDIR_SKIP_DELETED | READDIR_SKIP_LONG_NAME);
+    if (n < 0) {
+      return -1;
+    }
+    for (uint8_t i = 0; valid; i++, valid >>= 1) {
+      if ((valid & 1) && dirNameEqual(p[i].name, name)) {
+        return 1;
+      }
+    }
+  } while (n == 16);
+  return 0;
+}
+
+// Read the directory a block at a time and index every entry in use,
+// by its short name and by its long name if it has one.
+static uint8_t dirIndexBuild(sd_file* dirFile) {
+  for (uint16_t i = 0; i < dirFile->dirSlotCapacity_; i++) {
+    dirFile->dirSlots_[i].hash_ = 0;
+  }
+  dirFile->dirIndexState_ = DIR_INDEX_BUILT;
+  rewind(dirFile);
+  // long name in progress, lfnNext is the part expected next, zero once
+  // all parts are read or -1 if there is none
+  int8_t lfnNext = -1;
+  uint8_t lfnChk = 0;
+  uint16_t lfnLen = 0;
+  uint32_t lfnSum = 0;
+  int8_t n;
+  do {
+    dir_t* p;
+    uint16_t valid;
+    n = sd_readdir(dirFile, &p, &valid, READDIR_SKIP_DELETED);
+    if (n < 0) {
+      dirFile->dirIndexState_ = DIR_INDEX_EMPTY;
+      return false;
+    }
+    uint32_t block = dirFile->vol_->cacheBlockNumber_;
+    for (uint8_t i = 0; i < n; i++) {
+      dir_t* d = p + i;
+      if (!(valid & (1U << i))) {
+        lfnNext = -1;
+        continue;
+      }
+      if (DIR_IS_LONG_NAME(d)) {
+        uint8_t ord = d->name[0] & ~LDIR_ORD_LAST_LONG_ENTRY;
+        if (d->name[0] & LDIR_ORD_LAST_LONG_ENTRY) {
+          lfnChk = ((ldir_t*)d)->chksum;
+          lfnLen = ord * LDIR_NAME_CHARS;
+          lfnSum = 0;
+        } else if (lfnNext <= 0 || ord != lfnNext || ((ldir_t*)d)->chksum != lfnChk) {
+          lfnNext = -1;
+          continue;
+        }
+        uint16_t pos = (ord - 1) * LDIR_NAME_CHARS;
+        for (uint8_t j = 0; j < LDIR_NAME_CHARS; j++, pos++) {
+          uint16_t c = lfnGetChar(d, j);
+          if (c == 0) {
+            lfnLen = pos;
+            break;
+          }
+          lfnSum += lfnHashChar(c, pos);
+        }
+        lfnNext = ord ? ord - 1 : -1;
+        continue;
+      }
+      dirIndexInsert(dirFile, dirNameHash(d->name), block, i);
+      if (lfnNext == 0 && lfnLen <= LFN_NAME_MAX && lfnChecksum(d->name) == lfnChk) {
+        dirIndexInsert(dirFile, lfnSlotHash(lfnSum, lfnLen), block, i);
+      }
+      lfnNext = -1;
+    }
+  } while (n == 16);
+  return true;
+}
+
+static void dirIndexInsert(sd_file* dirFile, uint16_t hash, uint32_t block, uint8_t index) {
+  uint16_t i = hash % dirFile->dirSlotCapacity_;
+  for (uint16_t n = dirFile->dirSlotCapacity_; n; n--) {
+    sd_dir_slot* s = &dirFile->dirSlots_[i];
+    if (s->hash_ == 0) {
+      s->hash_ = hash;
+      s->dirBlock_ = block;
+      s->dirIndex_ = index;
+      return;
+    }
+    if (++i == dirFile->dirSlotCapacity_) {
+      i = 0;
+    }
+  }
+  dirFile->dirIndexState_ = DIR_INDEX_OVERFLOW;
+}
+
+// Index in its block of the short entry for the 8.3 name dname, or for
+// the long name of len characters if len is not zero. The block is left
+// in the cache. Returns -1 if the name is not in the directory, -2 on a
+// read error and -3 if a long name could not be checked from the index.
+static int16_t dirIndexFind(sd_file* dirFile, const uint8_t* dname, const char* name, uint8_t len) {
+  uint16_t hash = len ? lfnSlotHash(lfnHashSum(name, len), len) : dirNameHash(dname);
+  uint16_t i = hash % dirFile->dirSlotCapacity_;
+  int16_t rtn = -1;
+  for (uint16_t n = dirFile->dirSlotCapacity_; n; n--) {
+    sd_dir_slot* s = &dirFile->dirSlots_[i];
+    if (s->hash_ == 0) {
+      break;
+    }
+    if (s->hash_ == hash) {
+      if (len) {
+        int8_t r = lfnVerify(dirFile, s->dirBlock_, s->dirIndex_, name, len);
+        if (r == -2) {
+          return -2;
+        }
+        if (r < 0) {
+          rtn = -3;
+        } else if (r) {
+          return cacheRawBlock(dirFile->vol_, s->dirBlock_, CACHE_FOR_READ) ? s->dirIndex_ : -2;
+        }
+      } else {
+        if (!cacheRawBlock(dirFile->vol_, s->dirBlock_, CACHE_FOR_READ)) {
+          return -2;
+        }
+        if (dirNameEqual(dirFile->vol_->cacheBuffer_->dir[s->dirIndex_].name, dname)) {
+          return s->dirIndex_;
+        }
+      }
+    }
+    if (++i == dirFile->dirSlotCapacity_) {
+      i = 0;
+    }
+  }
+  return rtn;
+}
+
+// Open fileName in dirFile. A name that is not a valid 8.3 name is taken
+// as a long name, a new file gets long name entries and a short name
+// with a numeric tail.
 uint8_t sd_open(sd_file* dirFile, sd_file* pfile, const char* fileName, uint8_t oflag) {
   uint8_t dname[11];
   dir_t* p;
+  // length of a long name, zero for an 8.3 name
+  uint8_t len = 0;
 
   // error if already open
   if (isOpen(pfile)) {
@@ -463,68 +1263,231 @@ uint8_t sd_open(sd_file* dirFile, sd_file* pfile, const char* fileName, uint8_t
   }
 
   if (!make83Name(fileName, dname)) {
-    return false;
+    size_t n = strlen(fileName);
+    if (!lfnValidName(fileName, n)) {
+      return false;
+    }
+    len = n;
   }
   pfile->vol_ = dirFile->vol_;
-  rewind(pfile);
 
-  // bool for empty entry found
-  uint8_t emptyFound = false;
+  // entries created through another handle are not in the index, and
+  // the directory may have grown past the size known here
+  if (dirFile->dirChanges_ != dirFile->vol_->dirChanges_) {
+    dirFile->dirChanges_ = dirFile->vol_->dirChanges_;
+    dirFile->dirIndexState_ = DIR_INDEX_EMPTY;
+    if (dirFile->type_ != FAT_FILE_TYPE_ROOT16) {
+      dirFile->fileSize_ = FILE_SIZE_UNKNOWN;
+    }
+  }
 
-  // search for file
-  while (dirFile->curPosition_ < dirFile->fileSize_) {
-    uint8_t index = 0XF & (dirFile->curPosition_ >> 5);
-    p = readDirCache(dirFile);
-    if (p == NULL) {
+  // hash straight to the entry if the directory is indexed
+  if (dirFile->dirSlots_) {
+    if (dirFile->dirIndexState_ == DIR_INDEX_EMPTY && !dirIndexBuild(dirFile)) {
       return false;
     }
-
-    if (p->name[0] == DIR_NAME_FREE || p->name[0] == DIR_NAME_DELETED) {
-      // remember first empty slot
-      if (!emptyFound) {
-        emptyFound = true;
-        pfile->dirIndex_ = index;
-        pfile->dirBlock_ = dirFile->vol_->cacheBlockNumber_;
+    if (dirFile->dirIndexState_ == DIR_INDEX_BUILT) {
+      int16_t index = dirIndexFind(dirFile, dname, fileName, len);
+      if (index == -2) {
+        return false;
       }
-      // done if no entries follow
-      if (p->name[0] == DIR_NAME_FREE) {
-        break;
+      if (index >= 0) {
+        // don't open existing file if O_CREAT and O_EXCL
+        if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+          return false;
+        }
+        return openCachedEntry(pfile, index, oflag);
       }
-    } else if (!memcmp(dname, p->name, 11)) {
-      // don't open existing file if O_CREAT and O_EXCL
-      if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+      // not found - only a create needs to scan for free entries
+      if (index == -1 && (oflag & (O_CREAT | O_WRITE)) != (O_CREAT | O_WRITE)) {
         return false;
       }
-
-      // open found file
-      return openCachedEntry(pfile, 0XF & index, oflag);
     }
   }
+
+  // entries for a long name, the short entry follows them
+  uint8_t count = len ? (len + LDIR_NAME_CHARS - 1) / LDIR_NAME_CHARS : 0;
+  // short name for a new long name and numeric tails already in use,
+  // bit n for ~n of the basis and bit 16 + n for ~n of the hashed
+  // name in alt
+  uint8_t basis = 0;
+  uint32_t tails = 0;
+  uint8_t alt[11];
+  uint16_t h = 0;
+  if (len) {
+    h = lfnSlotHash(lfnHashSum(fileName, len), len);
+    basis = lfnShortBasis(fileName, len, dname);
+    memcpy(alt, dname, 11);
+    alt[1] = basis > 1 ? dname[1] : '_';
+    lfnHexHash(alt, h);
+  }
+  // first run of count + 1 unused entries, in entries from the start
+  uint32_t freeStart = 0;
+  uint8_t freeCount = 0;
+  // long name in progress, see dirIndexBuild()
+  int8_t lfnNext = -1;
+  uint8_t lfnChk = 0;
+  uint8_t lfnOk = false;
+
+  // search for file a block at a time
+  rewind(dirFile);
+  int8_t n;
+  do {
+    dir_t* entries;
+    uint16_t valid;
+    n = sd_readdir(dirFile, &entries, &valid, 0);
+    if (n < 0) {
+      return false;
+    }
+    if (!entries) {
+      break;
+    }
+    uint32_t first = (dirFile->curPosition_ >> 5) - 16;
+    for (uint8_t index = 0; index < 16; index++) {
+      p = entries + index;
+      if (index >= n || p->name[0] == DIR_NAME_DELETED) {
+        if (freeCount <= count) {
+          if (freeCount == 0) {
+            freeStart = first + index;
+          }
+          freeCount++;
+        }
+        lfnNext = -1;
+        // done if no entries follow
+        if (index >= n) {
+          break;
+        }
+        continue;
+      }
+      if (freeCount <= count) {
+        freeCount = 0;
+      }
+      if (DIR_IS_LONG_NAME(p)) {
+        if (len) {
+          uint8_t ord = p->name[0] & ~LDIR_ORD_LAST_LONG_ENTRY;
+          if (p->name[0] & LDIR_ORD_LAST_LONG_ENTRY) {
+            lfnChk = ((ldir_t*)p)->chksum;
+            lfnOk = ord == count;
+          } else if (lfnNext <= 0 || ord != lfnNext || ((ldir_t*)p)->chksum != lfnChk) {
+            lfnOk = false;
+          }
+          lfnOk = lfnOk && lfnMatchPart(p, fileName, len, ord);
+          lfnNext = ord ? ord - 1 : -1;
+        }
+        continue;
+      }
+      uint8_t found;
+      if (len) {
+        found = lfnOk && lfnNext == 0 && lfnChecksum(p->name) == lfnChk;
+        tails |= 1UL << lfnShortTail(p->name, dname, basis);
+        tails |= 1UL << (16 + lfnShortTail(p->name, alt, 6));
+      } else {
+        found = dirNameEqual(dname, p->name);
+      }
+      lfnNext = -1;
+      lfnOk = false;
+      if (found) {
+        // don't open existing file if O_CREAT and O_EXCL
+        if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+          return false;
+        }
+
+        // open found file
+        return openCachedEntry(pfile, index, oflag);
+      }
+    }
+  } while (n == 16);
   // only create file if O_CREAT and O_WRITE
   if ((oflag & (O_CREAT | O_WRITE)) != (O_CREAT | O_WRITE)) {
     return false;
   }
 
-  // cache found slot or add cluster if end of file
-  if (emptyFound) {
-    p = cacheDirEntry(pfile, CACHE_FOR_WRITE);
-    if (!p) {
-      return false;
+  if (len) {
+    // first numeric tail not in use, then the hashed name with tails
+    uint8_t t = 1;
+    while (t < 10 && (tails & (1UL << t))) {
+      t++;
     }
-  } else {
-    if (dirFile->type_ == FAT_FILE_TYPE_ROOT16) {
+    if (t < 10) {
+      dname[basis] = '~';
+      dname[basis + 1] = '0' + t;
+    } else {
+      memcpy(dname, alt, 11);
+      for (t = 1; t < 10 && (tails & (1UL << (16 + t))); t++) {
+      }
+      if (t < 10) {
+        dname[7] = '0' + t;
+      } else {
+        // all taken, other hashes are checked by a scan each
+        uint16_t k = 1;
+        for (;; k++) {
+          if (k == 0) {
+            return false;
+          }
+          lfnHexHash(dname, h + k * 0X9E37U);
+          int8_t used = dirShortNameUsed(dirFile, dname);
+          if (used < 0) {
+            return false;
+          }
+          if (!used) {
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  // a run too short for the entries is at the end of the directory, all
+  // entries after it are free, add clusters until it is long enough
+  if (freeCount <= count) {
+    if (dirFile->fileSize_ == FILE_SIZE_UNKNOWN &&
+        !chainSize(dirFile->vol_, dirFile->firstCluster_, &dirFile->fileSize_)) {
       return false;
     }
+    if (freeCount == 0) {
+      freeStart = dirFile->fileSize_ >> 5;
+    }
+    while ((dirFile->fileSize_ >> 5) - freeStart <= count) {
+      if (dirFile->type_ == FAT_FILE_TYPE_ROOT16) {
+        return false;
+      }
+      // addCluster() links the new cluster to curCluster_, the last one
+      if (!seekSet(dirFile, dirFile->fileSize_) || !addDirCluster(dirFile)) {
+        return false;
+      }
+    }
+  }
 
-    // add and zero cluster for dirFile - first cluster is in cache for write
-    if (!addDirCluster(pfile)) {
+  // long name entries, last part first. addCluster() leaves curCluster_
+  // on the new cluster so seek from the start.
+  rewind(dirFile);
+  if (!seekSet(dirFile, freeStart << 5)) {
+    return false;
+  }
+  uint8_t chk = lfnChecksum(dname);
+  for (uint8_t ord = count; ord > 0; ord--) {
+    p = readDirCache(dirFile);
+    if (!p) {
       return false;
     }
+    cacheSetDirty(dirFile->vol_);
+    memset(p, 0, sizeof(dir_t));
+    p->name[0] = ord == count ? ord | LDIR_ORD_LAST_LONG_ENTRY : ord;
+    p->attributes = DIR_ATT_LONG_NAME;
+    ((ldir_t*)p)->chksum = chk;
+    uint16_t pos = (ord - 1) * LDIR_NAME_CHARS;
+    for (uint8_t i = 0; i < LDIR_NAME_CHARS; i++, pos++) {
+      lfnPutChar(p, i, pos < len ? (uint8_t)fileName[pos] : pos == len ? 0 : 0XFFFF);
+    }
+  }
 
-    // use first entry in cluster
-    dirFile->dirIndex_ = 0;
-    p = dirFile->vol_->cacheBuffer_.dir;
+  // short entry
+  pfile->dirIndex_ = 0XF & (dirFile->curPosition_ >> 5);
+  p = readDirCache(dirFile);
+  if (!p) {
+    return false;
   }
+  cacheSetDirty(dirFile->vol_);
   // initialize as empty file
   memset(p, 0, sizeof(dir_t));
   memcpy(p->name, dname, 11);
@@ -547,13 +1510,134 @@ uint8_t sd_open(sd_file* dirFile, sd_file* pfile, const char* fileName, uint8_t
 //     return false;
 //   }
 
+  dirChanged(dirFile);
+
   // open entry in cache
-  return openCachedEntry(dirFile, dirFile->dirIndex_, oflag);
+  if (!openCachedEntry(pfile, pfile->dirIndex_, oflag)) {
+    return false;
+  }
+  if (dirFile->dirIndexState_ == DIR_INDEX_BUILT) {
+    dirIndexInsert(dirFile, dirNameHash(dname), pfile->dirBlock_, pfile->dirIndex_);
+    if (len) {
+      dirIndexInsert(dirFile, lfnSlotHash(lfnHashSum(fileName, len), len),
+                     pfile->dirBlock_, pfile->dirIndex_);
+    }
+  }
+  return true;
+}
+
+// Open the directory that starts at cluster, the root directory if
+// cluster is zero or the FAT32 root cluster.
+static uint8_t openDirCluster(sd_file* dir, sd_volume* vol, uint32_t cluster) {
+  memset(dir, 0, sizeof(sd_file));
+  if (cluster == 0 || (fatType(vol) == 32 && cluster == rootDirStart(vol))) {
+    return openRoot(dir, vol);
+  }
+  dir->vol_ = vol;
+  dir->type_ = FAT_FILE_TYPE_SUBDIR;
+  dir->firstCluster_ = cluster;
+  dir->fileSize_ = FILE_SIZE_UNKNOWN;
+  dir->flags_ = O_READ;
+  return true;
+}
+
+// Open the file or directory at path, names separated by '/', from the
+// root of vol. Names found before are taken from the volume dentry cache
+// so their directories are not scanned again, a long name costs one
+// block read to check it.
+uint8_t sd_open_path(sd_volume* vol, sd_file* pfile, const char* path, uint8_t oflag) {
+  if (isOpen(pfile)) {
+    return false;
+  }
+  uint32_t parent = fatType(vol) == 32 ? rootDirStart(vol) : 0;
+  for (;;) {
+    while (*path == '/') {
+      path++;
+    }
+    if (*path == '\0') {
+      // no name left, the path is the root
+      return openRoot(pfile, vol);
+    }
+    const char* end = path;
+    while (*end != '\0' && *end != '/') {
+      end++;
+    }
+    char part[LFN_NAME_MAX + 1];
+    uint8_t dname[11];
+    uint8_t len = 0;
+    if (end - path > LFN_NAME_MAX) {
+      return false;
+    }
+    memcpy(part, path, end - path);
+    part[end - path] = '\0';
+    if (!make83Name(part, dname)) {
+      // long names are remembered by their hash and length
+      uint32_t h = lfnHashSum(part, end - path);
+      len = end - path;
+      memset(dname, 0, 11);
+      memcpy(dname + 1, &h, 4);
+      dname[5] = len;
+    }
+    path = end;
+    while (*path == '/') {
+      path++;
+    }
+    uint8_t last = *path == '\0';
+
+    sd_dentry* d = dentryFind(vol, parent, dname);
+    if (d && len) {
+      // long names are keyed by a hash, check the name at the entry
+      sd_file dir;
+      if (!openDirCluster(&dir, vol, parent) ||
+          lfnVerify(&dir, d->dirBlock_, d->dirIndex_, part, len) != 1) {
+        d = NULL;
+      }
+    }
+    if (d && !last) {
+      // directory on the way, nothing to read
+      if (!(d->attributes_ & DIR_ATT_DIRECTORY)) {
+        return false;
+      }
+      parent = d->firstCluster_;
+      continue;
+    }
+    if (d) {
+      // check the entry is still there before it is opened
+      if (cacheRawBlock(vol, d->dirBlock_, CACHE_FOR_READ) &&
+          (len || dirNameEqual(vol->cacheBuffer_->dir[d->dirIndex_].name, dname))) {
+        // don't open existing file if O_CREAT and O_EXCL
+        if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+          return false;
+        }
+        pfile->vol_ = vol;
+        return openCachedEntry(pfile, d->dirIndex_, oflag);
+      }
+    }
+
+    // not remembered, scan the directory
+    sd_file dir;
+    sd_file sub;
+    sd_file* f = last ? pfile : &sub;
+    memset(&sub, 0, sizeof(sub));
+    if (!openDirCluster(&dir, vol, parent) ||
+        !sd_open(&dir, f, part, last ? oflag : O_READ)) {
+      return false;
+    }
+    dentryInsert(vol, parent, dname, f->dirBlock_, f->dirIndex_,
+                 isDir(f) ? DIR_ATT_DIRECTORY : 0, f->firstCluster_);
+    if (last) {
+      return true;
+    }
+    if (!isDir(&sub)) {
+      return false;
+    }
+    parent = sub.firstCluster_;
+  }
 }
 
 uint8_t openCachedEntry(sd_file* dirFile, uint8_t dirIndex, uint8_t oflag) {
   // location of entry in cache
-  dir_t* p = dirFile->vol_->cacheBuffer_.dir + dirIndex;
+  dir_t* p = dirFile->vol_->cacheBuffer_->dir + dirIndex;
 
   // write or truncate is an error for a directory or read-only file
   if (p->attributes & (DIR_ATT_READ_ONLY | DIR_ATT_DIRECTORY)) {
@@ -574,9 +1658,7 @@ uint8_t openCachedEntry(sd_file* dirFile, uint8_t dirIndex, uint8_t oflag) {
     dirFile->fileSize_ = p->fileSize;
     dirFile->type_ = FAT_FILE_TYPE_NORMAL;
   } else if (DIR_IS_SUBDIR(p)) {
-    if (!chainSize(dirFile->vol_, dirFile->firstCluster_, &dirFile->fileSize_)) {
-      return false;
-    }
+    dirFile->fileSize_ = FILE_SIZE_UNKNOWN;
     dirFile->type_ = FAT_FILE_TYPE_SUBDIR;
   } else {
     return false;
@@ -587,6 +1669,13 @@ uint8_t openCachedEntry(sd_file* dirFile, uint8_t dirIndex, uint8_t oflag) {
   // set to start of file
   dirFile->curCluster_ = 0;
   dirFile->curPosition_ = 0;
+  dirFile->extents_ = NULL;
+  dirFile->extentCount_ = 0;
+  dirFile->extentStride_ = 0;
+  dirFile->contiguous_ = FILE_CONTIGUOUS_UNKNOWN;
+  dirFile->dirSlots_ = NULL;
+  dirFile->dirIndexState_ = DIR_INDEX_EMPTY;
+  dirFile->dirChanges_ = dirFile->vol_->dirChanges_;
 
   // truncate file to zero length if requested
   if (oflag & O_TRUNC) {
@@ -643,6 +1732,11 @@ void rewind(sd_file* pfile) {
 }
 
 uint8_t addDirCluster(sd_file* pfile) {
+  // growing the directory needs its size
+  if (pfile->fileSize_ == FILE_SIZE_UNKNOWN &&
+      !chainSize(pfile->vol_, pfile->firstCluster_, &pfile->fileSize_)) {
+    return false;
+  }
   if (!addCluster(pfile)) {
     return false;
   }
@@ -656,13 +1750,37 @@ uint8_t addDirCluster(sd_file* pfile) {
   }
   // Increase directory file size by cluster size
   pfile->fileSize_ += 512UL << pfile->vol_->clusterSizeShift_;
+  dirChanged(pfile);
   return true;
 }
 
+// Count a change of dirFile so other handles of it drop their index and
+// size. The handle that made it is up to date if it was before.
+static void dirChanged(sd_file* dirFile) {
+  if (dirFile->dirChanges_ == dirFile->vol_->dirChanges_) {
+    dirFile->dirChanges_++;
+  }
+  dirFile->vol_->dirChanges_++;
+}
+
 uint8_t addCluster(sd_file* pfile) {
-  if (!allocContiguous(pfile, 1, &pfile->curCluster_)) {
+  if (!addClusters(pfile, 1)) {
     return false;
   }
+  pfile->contiguous_ = FILE_CONTIGUOUS_UNKNOWN;
+  return true;
+}
+
+// Add a run of up to count clusters after curCluster_, fewer when the
+// volume has no free run that long. curCluster_ is left on the first
+// new cluster.
+static uint8_t addClusters(sd_file* pfile, uint32_t count) {
+  while (!allocContiguous(pfile, count, &pfile->curCluster_)) {
+    if (count == 1) {
+      return false;
+    }
+    count >>= 1;
+  }
 
   // if first cluster of file link to directory entry
   if (pfile->firstCluster_ == 0) {
@@ -689,10 +1807,10 @@ uint8_t allocContiguous(sd_file* pfile, uint32_t count, uint32_t* curCluster) {
     setStart = false;
   } else {
     // start at likely place for free cluster
-    bgnCluster = pfile->allocSearchStart_;
+    bgnCluster = pfile->vol_->allocSearchStart_;
 
-    // save next search start if one cluster
-    setStart = 1 == count;
+    // save next search start
+    setStart = true;
   }
   // end of group
   uint32_t endCluster = bgnCluster;
@@ -700,42 +1818,42 @@ uint8_t allocContiguous(sd_file* pfile, uint32_t count, uint32_t* curCluster) {
   // last cluster of FAT
   uint32_t fatEnd = pfile->vol_->clusterCount_ + 1;
 
-  // search the FAT for free clusters
-  for (uint32_t n = 0;; n++, endCluster++) {
-    // can't find space checked all clusters
-    if (n >= pfile->vol_->clusterCount_) {
+  if (pfile->vol_->bitmap_) {
+    // search the free cluster bitmap a word at a time
+    if (!fatBitmapFind(pfile->vol_, bgnCluster, count, &bgnCluster)) {
       return false;
     }
+    endCluster = bgnCluster + count - 1;
+  } else {
+    // search the FAT for free clusters
+    for (uint32_t n = 0;; n++, endCluster++) {
+      // can't find space checked all clusters
+      if (n >= pfile->vol_->clusterCount_) {
+        return false;
+      }
 
-    // past end - start from beginning of FAT
-    if (endCluster > fatEnd) {
-      bgnCluster = endCluster = 2;
-    }
-    uint32_t f;
-    if (!fatGet(pfile->vol_, endCluster, &f)) {
-      return false;
-    }
+      // past end - start from beginning of FAT
+      if (endCluster > fatEnd) {
+        bgnCluster = endCluster = 2;
+      }
+      uint32_t f;
+      if (!fatGet(pfile->vol_, endCluster, &f)) {
+        return false;
+      }
 
-    if (f != 0) {
-      // cluster in use try next cluster as bgnCluster
-      bgnCluster = endCluster + 1;
-    } else if ((endCluster - bgnCluster + 1) == count) {
-      // done - found space
-      break;
+      if (f != 0) {
+        // cluster in use try next cluster as bgnCluster
+        bgnCluster = endCluster + 1;
+      } else if ((endCluster - bgnCluster + 1) == count) {
+        // done - found space
+        break;
+      }
     }
   }
-  // mark end of chain
-  if (!fatPutEOC(pfile->vol_, endCluster)) {
+  // link clusters and mark end of chain
+  if (!fatLinkRun(pfile->vol_, bgnCluster, endCluster - bgnCluster + 1)) {
     return false;
   }
-
-  // link clusters
-  while (endCluster > bgnCluster) {
-    if (!fatPut(pfile->vol_, endCluster - 1, endCluster)) {
-      return false;
-    }
-    endCluster--;
-  }
   if (*curCluster != 0) {
     // connect chains
     if (!fatPut(pfile->vol_, *curCluster, bgnCluster)) {
@@ -745,28 +1863,27 @@ uint8_t allocContiguous(sd_file* pfile, uint32_t count, uint32_t* curCluster) {
   // return first cluster number to caller
   *curCluster = bgnCluster;
 
-  // remember possible next free cluster
-  if (setStart) {
-    pfile->allocSearchStart_ = bgnCluster + 1;
+  // remember possible next free cluster - a single cluster search from
+  // the hint saw only used clusters before bgnCluster, a longer run may
+  // have skipped short free gaps so only move past it if it covers the hint
+  uint32_t hint = pfile->vol_->allocSearchStart_;
+  if ((setStart && count == 1) || (bgnCluster <= hint && hint <= endCluster)) {
+    pfile->vol_->allocSearchStart_ = endCluster + 1;
+    pfile->vol_->fsInfoDirty_ = true;
   }
 
   return true;
 }
 
-static uint8_t _cacheFlush(sd_file* pfile) {
-    return cacheFlush(pfile->vol_, false);
-}
-
 uint8_t cacheZeroBlock(sd_file* pfile, uint32_t blockNumber) {
-  if (!_cacheFlush(pfile)) {
+  if (!cacheClaimBlock(pfile->vol_, blockNumber)) {
     return false;
   }
 
-  // loop take less flash than memset(cacheBuffer_.data, 0, 512);
+  // loop take less flash than memset(cacheBuffer_->data, 0, 512);
   for (uint16_t i = 0; i < 512; i++) {
-    pfile->vol_->cacheBuffer_.data[i] = 0;
+    pfile->vol_->cacheBuffer_->data[i] = 0;
   }
-  pfile->vol_->cacheBlockNumber_ = blockNumber;
   cacheSetDirty(pfile->vol_);
   return true;
 }
@@ -54,6 +54,52 @@
 #define FAT_FILE_TYPE_SUBDIR  4
 /** Test value for directory type */
 // #define FAT_FILE_TYPE_MIN_DIR  FAT_FILE_TYPE_ROOT16;
+/** directory size not known until the end of its chain is read */
+#define FILE_SIZE_UNKNOWN  0XFFFFFFFF
+// values for contiguous_
+/** chain not checked since open or the last change */
+#define FILE_CONTIGUOUS_UNKNOWN  0
+/** all clusters of the file follow each other on the device */
+#define FILE_CONTIGUOUS_YES  1
+/** the chain has a gap */
+#define FILE_CONTIGUOUS_NO  2
+
+/** Clusters of a file that follow each other on the device */
+typedef struct __SD_EXTENT_PROT
+{
+  // index of the first cluster in the file
+  uint32_t fileCluster_;
+  uint32_t diskCluster_;
+  uint32_t length_;
+} sd_extent;
+
+// most clusters sd_write() allocates in one run
+#ifndef SD_WRITE_CLUSTER_BATCH
+#define SD_WRITE_CLUSTER_BATCH 32
+#endif
+
+/** longest long name sd_open() takes */
+#define LFN_NAME_MAX  255
+// sd_readdir() filter flags
+/** leave deleted entries out of the valid mask */
+#define READDIR_SKIP_DELETED  1
+/** leave long name entries out of the valid mask */
+#define READDIR_SKIP_LONG_NAME  2
+// values for dirIndexState_
+/** no index or not built since it was set */
+#define DIR_INDEX_EMPTY  0
+/** every entry of the directory is in the index */
+#define DIR_INDEX_BUILT  1
+/** the directory has more entries than slots, scan instead */
+#define DIR_INDEX_OVERFLOW  2
+
+/** Slot of a directory name index, hash_ is zero if the slot is free */
+typedef struct __SD_DIR_SLOT_PROT
+{
+  uint32_t dirBlock_;
+  uint16_t hash_;
+  uint8_t dirIndex_;
+} sd_dir_slot;
 
 typedef struct __SD_FILE_PROT
 {
@@ -69,10 +115,22 @@ typedef struct __SD_FILE_PROT
   uint32_t curCluster_;
   uint32_t curPosition_;
   uint8_t type_;
+  uint8_t contiguous_;
 //   uint8_t cacheDirty_;
   uint32_t dirBlock_;
   uint32_t dirIndex_;
-  uint32_t allocSearchStart_;
+  // optional map of the clusters walked so far, see setExtentMap()
+  sd_extent* extents_;
+  uint16_t extentCapacity_;
+  uint16_t extentCount_;
+  // least file clusters between extents once the map was full
+  uint32_t extentStride_;
+  // optional name index of a directory, see setDirIndex()
+  sd_dir_slot* dirSlots_;
+  uint16_t dirSlotCapacity_;
+  uint8_t dirIndexState_;
+  // volume dirChanges_ the index and size of the directory match
+  uint32_t dirChanges_;
   //------------------------------------------------------------------------------
 // callback function for date/time
 void (*dateTime_)(uint16_t* date, uint16_t* time);
@@ -101,6 +159,9 @@ uint32_t clusterStartBlock(sd_file* pfile, uint32_t cluster);
 void clearUnbufferedRead(sd_file* pfile);
 uint8_t unbufferedRead(sd_file* pfile);
 int16_t sd_read(sd_file* pfile);
+int32_t sd_read_buf(sd_file* pfile, void* buf, uint32_t nbyte);
+int32_t sd_write(sd_file* pfile, const void* buf, uint32_t nbyte);
+void setNonBlockingWrite(sd_file* pfile, uint8_t enable);
 uint8_t sd_open(sd_file* dirFile, sd_file* pfile, const char* fileName, uint8_t oflag);
 uint8_t openCachedEntry(sd_file* dirFile, uint8_t dirIndex, uint8_t oflag);
 uint8_t make83Name(const char* str, uint8_t* name);
@@ -110,6 +171,10 @@ uint8_t addCluster(sd_file* pfile);
 uint8_t allocContiguous(sd_file* pfile, uint32_t count, uint32_t* curCluster);
 uint8_t cacheZeroBlock(sd_file* pfile, uint32_t blockNumber);
 uint8_t sd_close(sd_file* pfile);
+void setExtentMap(sd_file* pfile, sd_extent* extents, uint16_t capacity);
+void setDirIndex(sd_file* dirFile, sd_dir_slot* slots, uint16_t capacity);
+uint8_t sd_open_path(sd_volume* vol, sd_file* pfile, const char* path, uint8_t oflag);
+int8_t sd_readdir(sd_file* dirFile, dir_t** entries, uint16_t* valid, uint8_t filter);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,224 @@
+#include "sd_stripe.h"
+
+// card holding a logical block
+static inline uint8_t stripeCard(sd_stripe* stripe, uint32_t block) {
+  return (block >> stripe->stripeShift_) & 1;
+}
+
+// block number on its card for a logical block, the second card starts
+// one stripe in
+static inline uint32_t stripeBlock(sd_stripe* stripe, uint32_t block) {
+  uint32_t mask = (1UL << stripe->stripeShift_) - 1;
+  uint32_t b = ((block >> (stripe->stripeShift_ + 1)) << stripe->stripeShift_) | (block & mask);
+  return stripeCard(stripe, block) ? b + (1UL << stripe->stripeShift_) : b;
+}
+
+// first block at or after block, and before end, that lives on card c
+static uint32_t nextOnCard(sd_stripe* stripe, uint32_t block, uint32_t end, uint8_t c) {
+  while (block < end && stripeCard(stripe, block) != c) {
+    block++;
+  }
+  return block;
+}
+
+uint8_t sd_stripe_init(sd_stripe* stripe, sd_card* card0, sd_card* card1, uint8_t stripeShift) {
+  stripe->card_[0] = card0;
+  stripe->card_[1] = card1;
+  stripe->stripeShift_ = stripeShift;
+  return init_sd_core(card0) && init_sd_core(card1);
+}
+
+uint8_t stripeReadData(sd_stripe* stripe, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+  return readData(stripe->card_[stripeCard(stripe, block)],
+                  stripeBlock(stripe, block), offset, count, dst);
+}
+
+uint8_t stripeReadBlock(sd_stripe* stripe, uint32_t block, uint8_t* dst) {
+  return readBlock(stripe->card_[stripeCard(stripe, block)],
+                   stripeBlock(stripe, block), dst);
+}
+
+uint8_t stripeWriteBlock(sd_stripe* stripe, uint32_t block, const uint8_t* src, uint8_t blocking) {
+  return writeBlock(stripe->card_[stripeCard(stripe, block)],
+                    stripeBlock(stripe, block), src, blocking);
+}
+
+// Retry a striped transfer that failed on the cards in the failed mask.
+// Each of them steps its clock down like a single card transfer.
+static uint8_t stripeRetry(sd_stripe* stripe, uint8_t failed, uint8_t attempt) {
+  for (uint8_t c = 0; c < SD_STRIPE_CARDS; c++) {
+    if (((failed >> c) & 1) && !retryTransfer(stripe->card_[c], attempt)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// One attempt to read a run, returns a mask of the cards that failed.
+static uint8_t stripeReadRun(sd_stripe* stripe, uint32_t block, uint32_t count, uint8_t* dst) {
+  uint32_t end = block + count;
+  uint32_t next[SD_STRIPE_CARDS];
+  uint8_t c;
+  uint8_t failed = 0;
+
+  for (c = 0; c < SD_STRIPE_CARDS; c++) {
+    next[c] = nextOnCard(stripe, block, end, c);
+    if (next[c] < end && !readStart(stripe->card_[c], stripeBlock(stripe, next[c]))) {
+      failed |= 1 << c;
+      end = 0;
+    }
+  }
+  while (!failed && (next[0] < end || next[1] < end)) {
+    // start one block on each card then wait for both
+    for (c = 0; c < SD_STRIPE_CARDS; c++) {
+      if (next[c] < end &&
+          !readNextStart(stripe->card_[c], dst + ((next[c] - block) << 9))) {
+        failed |= 1 << c;
+      }
+    }
+    for (c = 0; c < SD_STRIPE_CARDS; c++) {
+      if (next[c] < end) {
+        if (!transferFinish(stripe->card_[c])) {
+          failed |= 1 << c;
+        }
+        next[c] = nextOnCard(stripe, next[c] + 1, end, c);
+      }
+    }
+  }
+  for (c = 0; c < SD_STRIPE_CARDS; c++) {
+    if (!readStop(stripe->card_[c])) {
+      failed |= 1 << c;
+    }
+  }
+  return failed;
+}
+
+// Read a run of logical blocks. The part of the run on each card is
+// contiguous on that card, so each card gets one CMD18 and the blocks of
+// both cards are moved by DMA at the same time.
+uint8_t stripeReadBlocks(sd_stripe* stripe, uint32_t block, uint32_t count, uint8_t* dst) {
+  uint8_t failed;
+  for (uint8_t retry = 1; (failed = stripeReadRun(stripe, block, count, dst)); retry++) {
+    if (!stripeRetry(stripe, failed, retry)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// One attempt to write a run, returns a mask of the cards that failed.
+static uint8_t stripeWriteRun(sd_stripe* stripe, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+  uint32_t end = block + count;
+  uint32_t next[SD_STRIPE_CARDS];
+  uint8_t c;
+  uint8_t failed = 0;
+
+  for (c = 0; c < SD_STRIPE_CARDS; c++) {
+    next[c] = nextOnCard(stripe, block, end, c);
+    if (next[c] < end) {
+      // blocks of the run on this card
+      uint32_t n = 0;
+      for (uint32_t b = next[c]; b < end; b = nextOnCard(stripe, b + 1, end, c)) {
+        n++;
+      }
+      if (!writeStart(stripe->card_[c], stripeBlock(stripe, next[c]), n)) {
+        failed |= 1 << c;
+        end = 0;
+      }
+    }
+  }
+  while (!failed && (next[0] < end || next[1] < end)) {
+    for (c = 0; c < SD_STRIPE_CARDS; c++) {
+      if (next[c] < end &&
+          !writeNextStart(stripe->card_[c], src + ((next[c] - block) << 9))) {
+        failed |= 1 << c;
+      }
+    }
+    for (c = 0; c < SD_STRIPE_CARDS; c++) {
+      if (next[c] < end) {
+        if (!transferFinish(stripe->card_[c])) {
+          failed |= 1 << c;
+        }
+        next[c] = nextOnCard(stripe, next[c] + 1, end, c);
+      }
+    }
+  }
+  for (c = 0; c < SD_STRIPE_CARDS; c++) {
+    if (!writeStop(stripe->card_[c], blocking)) {
+      failed |= 1 << c;
+    }
+  }
+  return failed;
+}
+
+// Write a run of logical blocks with one CMD25 per card, sending the
+// blocks of both cards at the same time. blocking zero does not wait
+// for either card to finish programming.
+uint8_t stripeWriteBlocks(sd_stripe* stripe, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+  uint8_t failed;
+  for (uint8_t retry = 1; (failed = stripeWriteRun(stripe, block, count, src, blocking)); retry++) {
+    if (!stripeRetry(stripe, failed, retry)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// block_dev operations of a stripe set
+static uint8_t stripeDevReadData(void* ctx, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+  return stripeReadData((sd_stripe*)ctx, block, offset, count, dst);
+}
+
+static uint8_t stripeDevReadBlock(void* ctx, uint32_t block, uint8_t* dst) {
+  return stripeReadBlock((sd_stripe*)ctx, block, dst);
+}
+
+static uint8_t stripeDevWriteBlock(void* ctx, uint32_t block, const uint8_t* src, uint8_t blocking) {
+  return stripeWriteBlock((sd_stripe*)ctx, block, src, blocking);
+}
+
+static uint8_t stripeDevReadBlocks(void* ctx, uint32_t block, uint32_t count, uint8_t* dst) {
+  return stripeReadBlocks((sd_stripe*)ctx, block, count, dst);
+}
+
+static uint8_t stripeDevWriteBlocks(void* ctx, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+  return stripeWriteBlocks((sd_stripe*)ctx, block, count, src, blocking);
+}
+
+static uint8_t stripeDevSync(void* ctx) {
+  sd_stripe* stripe = (sd_stripe*)ctx;
+  uint8_t ok = true;
+  for (uint8_t c = 0; c < SD_STRIPE_CARDS; c++) {
+    if (!syncCard(stripe->card_[c])) {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// whole stripes that fit on the smaller card, on both cards, the first
+// stripe of the second card is not used
+static uint32_t stripeDevSectorCount(void* ctx) {
+  sd_stripe* stripe = (sd_stripe*)ctx;
+  uint32_t size0 = cardSize(stripe->card_[0]) >> stripe->stripeShift_;
+  uint32_t size1 = cardSize(stripe->card_[1]) >> stripe->stripeShift_;
+  size1 = size1 ? size1 - 1 : 0;
+  uint32_t size = size0 < size1 ? size0 : size1;
+  return size << (stripe->stripeShift_ + 1);
+}
+
+static const block_dev_ops stripeOps = {
+  stripeDevReadData,
+  stripeDevReadBlock,
+  stripeDevWriteBlock,
+  stripeDevReadBlocks,
+  stripeDevWriteBlocks,
+  stripeDevSync,
+  stripeDevSectorCount
+};
+
+// Use an initialized stripe set as the block device of a volume.
+void sd_stripe_block_dev(block_dev* dev, sd_stripe* stripe) {
+  dev->ops_ = &stripeOps;
+  dev->ctx_ = stripe;
+}
@@ -0,0 +1,38 @@
+#ifndef __SD_STRIPE_H
+#define __SD_STRIPE_H
+
+#include "sd_driver.h"
+
+/** number of cards in a stripe set */
+#define SD_STRIPE_CARDS 2
+
+/**
+   RAID-0 style block device over two cards. Logical blocks are split in
+   stripes of 1 << stripeShift_ blocks that alternate between the cards,
+   so a run of blocks keeps both cards busy at the same time.
+
+   The first stripe of the second card is not used, so its block zero,
+   which SD_PROTECT_BLOCK_ZERO refuses to write, is not part of the
+   volume. A transfer that fails is retried with the clock of the card
+   that failed stepped down, as on a single card.
+*/
+typedef struct __SD_STRIPE_PROT
+{
+  sd_card* card_[SD_STRIPE_CARDS];
+  uint8_t stripeShift_;
+} sd_stripe;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+uint8_t sd_stripe_init(sd_stripe* stripe, sd_card* card0, sd_card* card1, uint8_t stripeShift);
+uint8_t stripeReadData(sd_stripe* stripe, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst);
+uint8_t stripeReadBlock(sd_stripe* stripe, uint32_t block, uint8_t* dst);
+uint8_t stripeWriteBlock(sd_stripe* stripe, uint32_t block, const uint8_t* src, uint8_t blocking);
+uint8_t stripeReadBlocks(sd_stripe* stripe, uint32_t block, uint32_t count, uint8_t* dst);
+uint8_t stripeWriteBlocks(sd_stripe* stripe, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking);
+void sd_stripe_block_dev(block_dev* dev, sd_stripe* stripe);
+#ifdef __cplusplus
+}
+#endif
+#endif
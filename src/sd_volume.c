@@ -1,27 +1,67 @@
+#include <string.h>
 #include "sd_volume.h"
-#include "sd_driver.h"
 
 static uint8_t _sd_volume_init(sd_volume* pvolume, uint8_t partition);
-static uint8_t _cacheFlush(sd_volume* pvolume);
-
-uint8_t sd_volume_init(sd_volume* pvolume) {
+static void cacheInit(sd_volume* pvolume);
+static uint8_t fsInfoLoad(sd_volume* pvolume, uint32_t block);
+static cache_entry* cacheLoad(sd_volume* pvolume, uint32_t blockNumber);
+static uint8_t fatCacheFlush(sd_volume* pvolume, uint8_t blocking);
+static void fatRunChanged(sd_volume* pvolume, uint32_t cluster, uint32_t count, uint8_t used);
+
+// Mount the FAT volume on dev. The device must be ready, for a card
+// init_sd_core() has already been called.
+uint8_t sd_volume_init(sd_volume* pvolume, block_dev* dev) {
+  pvolume->dev_ = dev;
   return _sd_volume_init(pvolume, 1) ? true : _sd_volume_init(pvolume, 0); 
 }
 
+// block I/O on the device under the volume
+uint8_t devReadData(sd_volume* pvolume, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst) {
+  return pvolume->dev_->ops_->readData(pvolume->dev_->ctx_, block, offset, count, dst);
+}
+
+uint8_t devReadBlock(sd_volume* pvolume, uint32_t block, uint8_t* dst) {
+  return pvolume->dev_->ops_->readBlock(pvolume->dev_->ctx_, block, dst);
+}
+
+uint8_t devWriteBlock(sd_volume* pvolume, uint32_t block, const uint8_t* src, uint8_t blocking) {
+  return pvolume->dev_->ops_->writeBlock(pvolume->dev_->ctx_, block, src, blocking);
+}
+
+uint8_t devReadBlocks(sd_volume* pvolume, uint32_t block, uint32_t count, uint8_t* dst) {
+  return pvolume->dev_->ops_->readBlocks(pvolume->dev_->ctx_, block, count, dst);
+}
+
+uint8_t devWriteBlocks(sd_volume* pvolume, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking) {
+  return pvolume->dev_->ops_->writeBlocks(pvolume->dev_->ctx_, block, count, src, blocking);
+}
+
+uint8_t devSync(sd_volume* pvolume) {
+  return pvolume->dev_->ops_->sync(pvolume->dev_->ctx_);
+}
+
+uint32_t devSectorCount(sd_volume* pvolume) {
+  return pvolume->dev_->ops_->sectorCount(pvolume->dev_->ctx_);
+}
+
 static uint8_t _sd_volume_init(sd_volume* pvolume, uint8_t partition) {
     
-    pvolume->cacheDirty_ = 0;
-    pvolume->cacheBlockNumber_ = 0xFFFFFFFF;
-    pvolume->cacheMirrorBlock_ = 0;
+    cacheInit(pvolume);
+    pvolume->bitmap_ = NULL;
+    pvolume->fsInfoBlock_ = 0;
+    pvolume->dirChanges_ = 0;
+    pvolume->freeClusterCount_ = FSINFO_UNKNOWN;
+    pvolume->allocSearchStart_ = 2;
+    pvolume->fsInfoDirty_ = false;
+    dentryClear(pvolume);
 
     uint32_t volumeStartBlock = 0;
-    init_sd_core();
 
     if (partition > 0) {
 
       cacheRawBlock(pvolume, volumeStartBlock, CACHE_FOR_READ);
 
-      part_t* p = &pvolume->cacheBuffer_.mbr.part[partition - 1];
+      part_t* p = &pvolume->cacheBuffer_->mbr.part[partition - 1];
       if ((p->boot & 0X7F) != 0  ||
           p->totalSectors < 100 ||
           p->firstSector == 0) {
@@ -34,15 +74,16 @@ static uint8_t _sd_volume_init(sd_volume* pvolume, uint8_t partition) {
 
     cacheRawBlock(pvolume, volumeStartBlock, CACHE_FOR_READ);
     
-    bpb_t* bpb = &pvolume->cacheBuffer_.fbs.bpb;
+    bpb_t* bpb = &pvolume->cacheBuffer_->fbs.bpb;
     if (bpb->bytesPerSector != 512 ||
         bpb->fatCount == 0 ||
         bpb->reservedSectorCount == 0 ||
         bpb->sectorsPerCluster == 0) {
         // not valid FAT volume
-        return FALSE;
+        return false;
     }
     pvolume->fatCount_ = bpb->fatCount;
+    pvolume->fatCopies_ = bpb->fatCount;
     pvolume->blocksPerCluster_ = bpb->sectorsPerCluster;
 
     // determine shift that is same as multiply by blocksPerCluster_
@@ -50,7 +91,7 @@ static uint8_t _sd_volume_init(sd_volume* pvolume, uint8_t partition) {
     while (pvolume->blocksPerCluster_ != (1 << pvolume->clusterSizeShift_)) {
         // error if not power of 2
         if (pvolume->clusterSizeShift_++ > 7) {
-        return FALSE;
+        return false;
         }
     }
     pvolume->blocksPerFat_ = bpb->sectorsPerFat16 ?
@@ -84,25 +125,94 @@ static uint8_t _sd_volume_init(sd_volume* pvolume, uint8_t partition) {
     } else {
         pvolume->rootDirStart_ = bpb->fat32RootCluster;
         pvolume->fatType_ = 32;
+        // mirroring disabled - only the active FAT is used
+        if ((bpb->fat32Flags & 0X80) && (bpb->fat32Flags & 0XF) < pvolume->fatCount_) {
+            pvolume->fatStartBlock_ += (bpb->fat32Flags & 0XF) * pvolume->blocksPerFat_;
+            pvolume->fatCopies_ = 1;
+        }
+        if (bpb->fat32FSInfo) {
+            return fsInfoLoad(pvolume, volumeStartBlock + bpb->fat32FSInfo);
+        }
     }
-    return TRUE;
+    return true;
 }
 
-uint8_t cacheFlush(sd_volume* pvolume, uint8_t blocking) {
-  if (pvolume->cacheDirty_) {
-    if (!writeBlock(pvolume->cacheBlockNumber_, pvolume->cacheBuffer_.data, blocking)) {
-      return false;
+// Take the free count and next free hint from the FSINFO sector. A
+// missing or damaged FSINFO is ignored, the values are then unknown.
+static uint8_t fsInfoLoad(sd_volume* pvolume, uint32_t block) {
+    if (!cacheRawBlock(pvolume, block, CACHE_FOR_READ)) {
+        return false;
     }
-
-    if (!blocking) {
-      return true;
+    fsinfo_t* fsi = &pvolume->cacheBuffer_->fsinfo;
+    if (fsi->leadSignature != FSINFO_LEAD_SIG ||
+        fsi->structSignature != FSINFO_STRUCT_SIG) {
+        return true;
     }
+    pvolume->fsInfoBlock_ = block;
+    if (fsi->freeCount <= pvolume->clusterCount_) {
+        pvolume->freeClusterCount_ = fsi->freeCount;
+    }
+    if (fsi->nextFree >= 2 && fsi->nextFree <= pvolume->clusterCount_ + 1) {
+        pvolume->allocSearchStart_ = fsi->nextFree;
+    }
+    return true;
+}
 
-    // mirror FAT tables
-    if (!cacheMirrorBlockFlush(pvolume, blocking)) {
+static void cacheInitEntries(cache_entry* entries, uint8_t count) {
+  for (uint8_t i = 0; i < count; i++) {
+    cache_entry* e = &entries[i];
+    e->blockNumber_ = 0XFFFFFFFF;
+    e->lastUse_ = 0;
+    e->dirty_ = 0;
+  }
+}
+
+static void cacheInit(sd_volume* pvolume) {
+  cacheInitEntries(pvolume->cacheEntries_, SD_CACHE_ENTRIES);
+  for (uint8_t i = 0; i < SD_FAT_CACHE_ENTRIES; i++) {
+    pvolume->fatCache_[i].blockNumber_ = 0XFFFFFFFF;
+    pvolume->fatCache_[i].dirty_ = 0;
+  }
+  pvolume->fatCacheHits_ = 0;
+  pvolume->fatCacheMisses_ = 0;
+  pvolume->cacheCurrent_ = pvolume->cacheEntries_;
+  pvolume->cacheBuffer_ = &pvolume->cacheEntries_[0].buffer_;
+  pvolume->cacheBlockNumber_ = 0XFFFFFFFF;
+  pvolume->cacheClock_ = 0;
+  pvolume->cacheHits_ = 0;
+  pvolume->cacheMisses_ = 0;
+}
+
+// Write a dirty entry to the device.
+static uint8_t cacheWriteBack(sd_volume* pvolume, cache_entry* e, uint8_t blocking) {
+  if (!e->dirty_) {
+    return true;
+  }
+  if (!devWriteBlock(pvolume, e->blockNumber_, e->buffer_.data, blocking)) {
+    return false;
+  }
+  e->dirty_ = 0;
+  return true;
+}
+
+uint8_t cacheFlush(sd_volume* pvolume, uint8_t blocking) {
+  if (pvolume->fsInfoDirty_ && pvolume->fsInfoBlock_) {
+    cache_entry* e = cacheLoad(pvolume, pvolume->fsInfoBlock_);
+    if (!e) {
+      return false;
+    }
+    e->buffer_.fsinfo.freeCount = pvolume->freeClusterCount_;
+    e->buffer_.fsinfo.nextFree = pvolume->allocSearchStart_;
+    e->dirty_ = CACHE_FOR_WRITE;
+    pvolume->fsInfoDirty_ = false;
+  }
+  if (!fatCacheFlush(pvolume, blocking)) {
+    return false;
+  }
+  for (uint8_t i = 0; i < SD_CACHE_ENTRIES; i++) {
+    if (!cacheWriteBack(pvolume, &pvolume->cacheEntries_[i], blocking)) {
       return false;
     }
-    pvolume->cacheDirty_ = 0;
   }
   return true;
 }
@@ -121,11 +231,14 @@ uint32_t rootDirStart(sd_volume* pvolume) {
 
 uint8_t chainSize(sd_volume* pvolume, uint32_t cluster, uint32_t* size) {
   uint32_t s = 0;
+  uint32_t next[16];
+  uint32_t n;
   do {
-    if (!fatGet(pvolume, cluster, &cluster)) {
+    if (!fatReadChainBatch(pvolume, cluster, next, 16, &n)) {
       return false;
     }
-    s += 512UL << pvolume->clusterSizeShift_;
+    s += n << (pvolume->clusterSizeShift_ + 9);
+    cluster = next[n - 1];
   } while (!isEOC(pvolume, cluster));
   *size = s;
   return true;
@@ -133,32 +246,216 @@ uint8_t chainSize(sd_volume* pvolume, uint32_t cluster, uint32_t* size) {
 
 
 
-uint8_t cacheMirrorBlockFlush(sd_volume* pvolume, uint8_t blocking) {
-  if (pvolume->cacheMirrorBlock_) {
-    if (!writeBlock(pvolume->cacheMirrorBlock_, pvolume->cacheBuffer_.data, blocking)) {
-      return false;
+static cache_entry* cacheFind(cache_entry* entries, uint8_t count, uint32_t blockNumber) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (entries[i].blockNumber_ == blockNumber) {
+      return &entries[i];
     }
-    pvolume->cacheMirrorBlock_ = 0;
   }
-  return true;
+  return NULL;
+}
+
+// Free the least recently used of entries, writing it back if dirty.
+static cache_entry* cacheEvict(sd_volume* pvolume, cache_entry* entries, uint8_t count) {
+  cache_entry* e = entries;
+  for (uint8_t i = 1; i < count; i++) {
+    if (entries[i].lastUse_ < e->lastUse_) {
+      e = &entries[i];
+    }
+  }
+  if (!cacheWriteBack(pvolume, e, false)) {
+    return NULL;
+  }
+  e->blockNumber_ = 0XFFFFFFFF;
+  // the current block may be the one replaced
+  pvolume->cacheBlockNumber_ = pvolume->cacheCurrent_->blockNumber_;
+  return e;
+}
+
+// make e the block returned by cacheBuffer_
+static void cacheSelect(sd_volume* pvolume, cache_entry* e) {
+  e->lastUse_ = ++pvolume->cacheClock_;
+  pvolume->cacheCurrent_ = e;
+  pvolume->cacheBuffer_ = &e->buffer_;
+  pvolume->cacheBlockNumber_ = e->blockNumber_;
+}
+
+// Find or read blockNumber in the cache without making it current.
+static cache_entry* cacheLoad(sd_volume* pvolume, uint32_t blockNumber) {
+  cache_entry* e = pvolume->cacheBlockNumber_ == blockNumber ?
+                   pvolume->cacheCurrent_ :
+                   cacheFind(pvolume->cacheEntries_, SD_CACHE_ENTRIES, blockNumber);
+  if (e) {
+    pvolume->cacheHits_++;
+  } else {
+    pvolume->cacheMisses_++;
+    e = cacheEvict(pvolume, pvolume->cacheEntries_, SD_CACHE_ENTRIES);
+    if (!e || !devReadBlock(pvolume, blockNumber, e->buffer_.data)) {
+      return NULL;
+    }
+    e->blockNumber_ = blockNumber;
+  }
+  e->lastUse_ = ++pvolume->cacheClock_;
+  return e;
 }
 
 uint8_t cacheRawBlock(sd_volume* pvolume, uint32_t blockNumber, uint8_t action) {
-  if (pvolume->cacheBlockNumber_ != blockNumber) {
-    if (!_cacheFlush(pvolume)) {
+  cache_entry* e = cacheLoad(pvolume, blockNumber);
+  if (!e) {
+    return false;
+  }
+  cacheSelect(pvolume, e);
+  e->dirty_ |= action;
+  return true;
+}
+
+// Make blockNumber the current block without reading it from the
+// device. The caller fills cacheBuffer_ and marks it dirty.
+uint8_t cacheClaimBlock(sd_volume* pvolume, uint32_t blockNumber) {
+  cache_entry* e = cacheFind(pvolume->cacheEntries_, SD_CACHE_ENTRIES, blockNumber);
+  if (!e) {
+    e = cacheEvict(pvolume, pvolume->cacheEntries_, SD_CACHE_ENTRIES);
+    if (!e) {
       return false;
     }
-    if (!readBlock(blockNumber, pvolume->cacheBuffer_.data)) {
-      return false;
+    e->blockNumber_ = blockNumber;
+  }
+  cacheSelect(pvolume, e);
+  return true;
+}
+
+// Number of blocks from blockNumber, up to count, that are not in the
+// cache and may be transferred without going through it.
+uint32_t cacheUncachedRun(sd_volume* pvolume, uint32_t blockNumber, uint32_t count) {
+  for (uint8_t i = 0; i < SD_CACHE_ENTRIES; i++) {
+    uint32_t b = pvolume->cacheEntries_[i].blockNumber_;
+    if (b >= blockNumber && b - blockNumber < count) {
+      count = b - blockNumber;
+    }
+  }
+  return count;
+}
+
+uint32_t cacheHits(sd_volume* pvolume) {
+  return pvolume->cacheHits_;
+}
+
+uint32_t cacheMisses(sd_volume* pvolume) {
+  return pvolume->cacheMisses_;
+}
+
+uint32_t fatCacheHits(sd_volume* pvolume) {
+  return pvolume->fatCacheHits_;
+}
+
+uint32_t fatCacheMisses(sd_volume* pvolume) {
+  return pvolume->fatCacheMisses_;
+}
+
+// Forget every remembered directory entry.
+void dentryClear(sd_volume* pvolume) {
+  for (uint8_t i = 0; i < SD_DENTRY_ENTRIES; i++) {
+    pvolume->dentries_[i].dirBlock_ = 0;
+  }
+  pvolume->dentryClock_ = 0;
+}
+
+// Remembered entry for the 8.3 name in the directory that starts at
+// cluster parent, NULL if there is none.
+sd_dentry* dentryFind(sd_volume* pvolume, uint32_t parent, const uint8_t* name) {
+  for (uint8_t i = 0; i < SD_DENTRY_ENTRIES; i++) {
+    sd_dentry* d = &pvolume->dentries_[i];
+    if (d->dirBlock_ && d->parent_ == parent && !memcmp(d->name_, name, 11)) {
+      d->lastUse_ = ++pvolume->dentryClock_;
+      return d;
+    }
+  }
+  return NULL;
+}
+
+// Remember where name was found in parent, replacing an older entry for
+// the name or else the least recently used one.
+void dentryInsert(sd_volume* pvolume, uint32_t parent, const uint8_t* name,
+                  uint32_t dirBlock, uint8_t dirIndex, uint8_t attributes, uint32_t firstCluster) {
+  sd_dentry* d = dentryFind(pvolume, parent, name);
+  if (!d) {
+    d = pvolume->dentries_;
+    for (uint8_t i = 1; i < SD_DENTRY_ENTRIES && d->dirBlock_; i++) {
+      sd_dentry* e = &pvolume->dentries_[i];
+      if (!e->dirBlock_ || e->lastUse_ < d->lastUse_) {
+        d = e;
+      }
+    }
+  }
+  d->parent_ = parent;
+  memcpy(d->name_, name, 11);
+  d->dirBlock_ = dirBlock;
+  d->dirIndex_ = dirIndex;
+  d->attributes_ = attributes;
+  d->firstCluster_ = firstCluster;
+  d->lastUse_ = ++pvolume->dentryClock_;
+}
+
+// Write the dirty FAT blocks to every maintained FAT copy, a copy at a
+// time in block order. Dirty blocks in neighbouring slots that are also
+// neighbours in the FAT go out as one multi-block write.
+static uint8_t fatCacheFlush(sd_volume* pvolume, uint8_t blocking) {
+  fat_cache_slot* slot = pvolume->fatCache_;
+  for (uint8_t copy = 0; copy < pvolume->fatCopies_; copy++) {
+    uint32_t next = 0;
+    for (;;) {
+      // dirty block with the lowest number not yet written
+      uint8_t first = SD_FAT_CACHE_ENTRIES;
+      for (uint8_t i = 0; i < SD_FAT_CACHE_ENTRIES; i++) {
+        if (slot[i].dirty_ && slot[i].blockNumber_ >= next &&
+            (first == SD_FAT_CACHE_ENTRIES || slot[i].blockNumber_ < slot[first].blockNumber_)) {
+          first = i;
+        }
+      }
+      if (first == SD_FAT_CACHE_ENTRIES) {
+        break;
+      }
+      uint8_t n = 1;
+      while (first + n < SD_FAT_CACHE_ENTRIES && slot[first + n].dirty_ &&
+             slot[first + n].blockNumber_ == slot[first].blockNumber_ + n) {
+        n++;
+      }
+      uint32_t block = slot[first].blockNumber_ + copy * pvolume->blocksPerFat_;
+      uint8_t* src = pvolume->fatCacheData_[first].data;
+      if (!(n == 1 ? devWriteBlock(pvolume, block, src, blocking) :
+                     devWriteBlocks(pvolume, block, n, src, blocking))) {
+        return false;
+      }
+      next = slot[first].blockNumber_ + n;
     }
-    pvolume->cacheBlockNumber_ = blockNumber;
   }
-  pvolume->cacheDirty_ |= action;
+  for (uint8_t i = 0; i < SD_FAT_CACHE_ENTRIES; i++) {
+    slot[i].dirty_ = 0;
+  }
   return true;
 }
 
-static uint8_t _cacheFlush(sd_volume* pvolume) {
-  cacheFlush(pvolume, false);
+// Get the FAT block lba from the FAT cache. Walking a chain never
+// replaces data or directory blocks.
+static cache* fatCacheBlock(sd_volume* pvolume, uint32_t lba, uint8_t action) {
+  uint8_t i = (lba - pvolume->fatStartBlock_) % SD_FAT_CACHE_ENTRIES;
+  fat_cache_slot* slot = &pvolume->fatCache_[i];
+  if (slot->blockNumber_ == lba) {
+    pvolume->fatCacheHits_++;
+  } else {
+    pvolume->fatCacheMisses_++;
+    // write all dirty FAT blocks together, not just the one replaced
+    if (slot->dirty_ && !fatCacheFlush(pvolume, false)) {
+      return NULL;
+    }
+    slot->blockNumber_ = 0XFFFFFFFF;
+    if (!devReadBlock(pvolume, lba, pvolume->fatCacheData_[i].data)) {
+      return NULL;
+    }
+    slot->blockNumber_ = lba;
+  }
+  slot->dirty_ |= action;
+  return &pvolume->fatCacheData_[i];
 }
 
 uint8_t fatGet(sd_volume* pvolume, uint32_t cluster, uint32_t* value) {
@@ -167,19 +464,178 @@ uint8_t fatGet(sd_volume* pvolume, uint32_t cluster, uint32_t* value) {
   }
   uint32_t lba = pvolume->fatStartBlock_;
   lba += pvolume->fatType_ == 16 ? cluster >> 8 : cluster >> 7;
-  if (lba != pvolume->cacheBlockNumber_) {
-    if (!cacheRawBlock(pvolume, lba, CACHE_FOR_READ)) {
-      return false;
-    }
+  cache* fat = fatCacheBlock(pvolume, lba, CACHE_FOR_READ);
+  if (!fat) {
+    return false;
   }
   if (pvolume->fatType_ == 16) {
-    *value = pvolume->cacheBuffer_.fat16[cluster & 0XFF];
+    *value = fat->fat16[cluster & 0XFF];
   } else {
-    *value = pvolume->cacheBuffer_.fat32[cluster & 0X7F] & FAT32MASK;
+    *value = fat->fat32[cluster & 0X7F] & FAT32MASK;
+  }
+  return true;
+}
+
+// Free clusters on the volume. A FAT32 volume normally has the count
+// from FSINFO, otherwise the FAT is counted once and the result kept.
+uint8_t freeClusterCount(sd_volume* pvolume, uint32_t* count) {
+  if (pvolume->freeClusterCount_ == FSINFO_UNKNOWN) {
+    uint32_t n = 0;
+    uint32_t entries = pvolume->fatType_ == 16 ? 256 : 128;
+    uint32_t fatEnd = pvolume->clusterCount_ + 1;
+    for (uint32_t first = 0; first <= fatEnd; first += entries) {
+      cache* fat = fatCacheBlock(pvolume, pvolume->fatStartBlock_ + first / entries, CACHE_FOR_READ);
+      if (!fat) {
+        return false;
+      }
+      for (uint32_t i = 0; i < entries; i++) {
+        uint32_t cluster = first + i;
+        if (cluster < 2 || cluster > fatEnd) {
+          continue;
+        }
+        uint32_t f = pvolume->fatType_ == 16 ? fat->fat16[i] : fat->fat32[i] & FAT32MASK;
+        if (f == 0) {
+          n++;
+        }
+      }
+    }
+    pvolume->freeClusterCount_ = n;
+    pvolume->fsInfoDirty_ = true;
+  }
+  *count = pvolume->freeClusterCount_;
+  return true;
+}
+
+// log2 of the FAT entries in a block, also one bitmap region
+static uint8_t fatBlockShift(sd_volume* pvolume) {
+  return pvolume->fatType_ == 16 ? 8 : 7;
+}
+
+static uint32_t bitmapRegions(sd_volume* pvolume) {
+  uint8_t shift = fatBlockShift(pvolume);
+  return (pvolume->clusterCount_ + 2 + (1UL << shift) - 1) >> shift;
+}
+
+static uint8_t bitmapIsLoaded(sd_volume* pvolume, uint32_t region) {
+  return (pvolume->bitmapLoaded_[region >> 5] >> (region & 31)) & 1;
+}
+
+// Fill the bitmap words of region from its FAT block. Reserved clusters
+// and entries past the end of the FAT are marked in use.
+static uint8_t bitmapLoad(sd_volume* pvolume, uint32_t region) {
+  if (bitmapIsLoaded(pvolume, region)) {
+    return true;
+  }
+  cache* fat = fatCacheBlock(pvolume, pvolume->fatStartBlock_ + region, CACHE_FOR_READ);
+  if (!fat) {
+    return false;
+  }
+  uint8_t shift = fatBlockShift(pvolume);
+  uint32_t first = region << shift;
+  uint32_t fatEnd = pvolume->clusterCount_ + 1;
+  uint32_t* w = pvolume->bitmap_ + (first >> 5);
+  for (uint16_t i = 0; i < (1U << shift); i += 32) {
+    uint32_t used = 0;
+    for (uint8_t b = 0; b < 32; b++) {
+      uint32_t cluster = first + i + b;
+      uint32_t f = shift == 8 ? fat->fat16[i + b] : fat->fat32[i + b] & FAT32MASK;
+      if (f != 0 || cluster < 2 || cluster > fatEnd) {
+        used |= 1UL << b;
+      }
+    }
+    *w++ = used;
   }
+  pvolume->bitmapLoaded_[region >> 5] |= 1UL << (region & 31);
   return true;
 }
 
+// Words of RAM fatBitmapInit() needs for this volume, one bit per
+// cluster plus one bit per FAT block.
+uint32_t fatBitmapWords(sd_volume* pvolume) {
+  uint32_t regions = bitmapRegions(pvolume);
+  return (regions << (fatBlockShift(pvolume) - 5)) + ((regions + 31) >> 5);
+}
+
+// Use words as a free cluster bitmap for allocation. Regions of the
+// bitmap are filled from the FAT the first time a search reaches them.
+// Pass NULL to go back to searching the FAT.
+uint8_t fatBitmapInit(sd_volume* pvolume, uint32_t* words, uint32_t wordCount) {
+  pvolume->bitmap_ = NULL;
+  if (!words) {
+    return true;
+  }
+  if (wordCount < fatBitmapWords(pvolume)) {
+    return false;
+  }
+  uint32_t regions = bitmapRegions(pvolume);
+  pvolume->bitmapLoaded_ = words + (regions << (fatBlockShift(pvolume) - 5));
+  for (uint32_t i = 0; i < (regions + 31) >> 5; i++) {
+    pvolume->bitmapLoaded_[i] = 0;
+  }
+  pvolume->bitmap_ = words;
+  return true;
+}
+
+// Find count free clusters in a row with the bitmap, searching from
+// start to the end of the FAT then from cluster 2. The first cluster of
+// the run is returned in first.
+uint8_t fatBitmapFind(sd_volume* pvolume, uint32_t start, uint32_t count, uint32_t* first) {
+  uint32_t fatEnd = pvolume->clusterCount_ + 1;
+  uint8_t shift = fatBlockShift(pvolume);
+  uint8_t wrapped = false;
+  if (!pvolume->bitmap_ || count == 0) {
+    return false;
+  }
+  if (start < 2 || start > fatEnd) {
+    start = 2;
+  }
+  uint32_t cluster = start;
+  uint32_t runStart = start;
+  for (;;) {
+    if (cluster > fatEnd) {
+      // a run may not wrap past the end of the FAT
+      if (wrapped || start == 2) {
+        return false;
+      }
+      wrapped = true;
+      cluster = runStart = 2;
+    }
+    if (wrapped && runStart >= start) {
+      return false;
+    }
+    if (!bitmapLoad(pvolume, cluster >> shift)) {
+      return false;
+    }
+    uint8_t bit = cluster & 31;
+    uint32_t used = pvolume->bitmap_[cluster >> 5] >> bit;
+    uint32_t avail = 32 - bit;
+    if (cluster == runStart) {
+      // skip clusters in use
+      uint32_t freeBits = bit ? ~used & ((1UL << avail) - 1) : ~used;
+      if (freeBits == 0) {
+        cluster += avail;
+        runStart = cluster;
+        continue;
+      }
+      uint8_t k = __builtin_ctz(freeBits);
+      cluster += k;
+      runStart = cluster;
+      used >>= k;
+      avail -= k;
+    }
+    // free clusters up to the next one in use or the end of the word
+    uint32_t k = used ? (uint32_t)__builtin_ctz(used) : avail;
+    if (cluster - runStart + k >= count) {
+      *first = runStart;
+      return true;
+    }
+    cluster += k;
+    if (k < avail) {
+      runStart = cluster;
+    }
+  }
+}
+
 // Store a FAT entry
 uint8_t fatPut(sd_volume* pvolume, uint32_t cluster, uint32_t value) {
   // error if reserved cluster
@@ -196,23 +652,179 @@ uint8_t fatPut(sd_volume* pvolume, uint32_t cluster, uint32_t value) {
   uint32_t lba = pvolume->fatStartBlock_;
   lba += pvolume->fatType_ == 16 ? cluster >> 8 : cluster >> 7;
 
-  if (lba != pvolume->cacheBlockNumber_) {
-    if (!cacheRawBlock(pvolume, lba, CACHE_FOR_READ)) {
-      return false;
-    }
+  // all FAT copies are written when the block is flushed
+  cache* fat = fatCacheBlock(pvolume, lba, CACHE_FOR_WRITE);
+  if (!fat) {
+    return false;
   }
   // store entry
+  uint32_t old;
   if (pvolume->fatType_ == 16) {
-    pvolume->cacheBuffer_.fat16[cluster & 0XFF] = value;
+    old = fat->fat16[cluster & 0XFF];
+    fat->fat16[cluster & 0XFF] = value;
   } else {
-    pvolume->cacheBuffer_.fat32[cluster & 0X7F] = value;
+    old = fat->fat32[cluster & 0X7F] & FAT32MASK;
+    fat->fat32[cluster & 0X7F] = value;
+  }
+  if ((old == 0) != (value == 0)) {
+    fatRunChanged(pvolume, cluster, 1, value != 0);
+  }
+  return true;
+}
+
+// Account for count clusters from cluster that all went from free to
+// used or from used to free: free count, search start, FSINFO and a
+// loaded bitmap region. The clusters must be in one FAT block.
+static void fatRunChanged(sd_volume* pvolume, uint32_t cluster, uint32_t count, uint8_t used) {
+  if (pvolume->freeClusterCount_ != FSINFO_UNKNOWN) {
+    if (used) {
+      pvolume->freeClusterCount_ -= count;
+    } else {
+      pvolume->freeClusterCount_ += count;
+    }
+  }
+  if (!used && cluster < pvolume->allocSearchStart_) {
+    pvolume->allocSearchStart_ = cluster;
+  }
+  pvolume->fsInfoDirty_ = true;
+
+  // keep a loaded bitmap region in step with the FAT, a word at a time
+  if (pvolume->bitmap_ && bitmapIsLoaded(pvolume, cluster >> fatBlockShift(pvolume))) {
+    while (count) {
+      uint8_t bit = cluster & 31;
+      uint8_t n = (uint8_t)(count < 32U - bit ? count : 32U - bit);
+      uint32_t mask = (n == 32 ? 0XFFFFFFFF : (1UL << n) - 1) << bit;
+      if (used) {
+        pvolume->bitmap_[cluster >> 5] |= mask;
+      } else {
+        pvolume->bitmap_[cluster >> 5] &= ~mask;
+      }
+      cluster += n;
+      count -= n;
+    }
+  }
+}
+
+// Link the free clusters first .. first + count - 1 into one chain that
+// ends with EOC. Each FAT block is updated under one cache lookup.
+// Nothing is changed if a cluster of the run is in use.
+uint8_t fatLinkRun(sd_volume* pvolume, uint32_t first, uint32_t count) {
+  uint8_t shift = fatBlockShift(pvolume);
+  uint32_t mask = (1UL << shift) - 1;
+  uint32_t last = first + count - 1;
+  if (count == 0 || first < 2 || last > pvolume->clusterCount_ + 1) {
+    return false;
+  }
+  // the whole run must be free before any link is stored
+  for (uint32_t cluster = first; cluster <= last; cluster = (cluster | mask) + 1) {
+    cache* fat = fatCacheBlock(pvolume, pvolume->fatStartBlock_ + (cluster >> shift), CACHE_FOR_READ);
+    if (!fat) {
+      return false;
+    }
+    uint32_t end = (cluster | mask) < last ? (cluster | mask) + 1 : last + 1;
+    for (uint32_t c = cluster; c < end; c++) {
+      uint32_t f = pvolume->fatType_ == 16 ? fat->fat16[c & mask] :
+                                             fat->fat32[c & mask] & FAT32MASK;
+      if (f) {
+        // the run was not free, caller error
+        return false;
+      }
+    }
+  }
+  uint32_t cluster = first;
+  while (cluster <= last) {
+    cache* fat = fatCacheBlock(pvolume, pvolume->fatStartBlock_ + (cluster >> shift), CACHE_FOR_WRITE);
+    if (!fat) {
+      return false;
+    }
+    // part of the run in this block, the chain ends in it if last does
+    uint32_t end = (cluster | mask) < last ? (cluster | mask) + 1 : last + 1;
+    uint32_t n = end - cluster;
+    if (pvolume->fatType_ == 16) {
+      uint16_t* p = fat->fat16 + (cluster & mask);
+      for (uint32_t c = cluster; c < end; c++, p++) {
+        *p = c + 1;
+      }
+      if (end == last + 1) {
+        p[-1] = FAT16EOC;
+      }
+    } else {
+      uint32_t* p = fat->fat32 + (cluster & mask);
+      for (uint32_t c = cluster; c < end; c++, p++) {
+        *p = c + 1;
+      }
+      if (end == last + 1) {
+        p[-1] = FAT32EOC;
+      }
+    }
+    fatRunChanged(pvolume, cluster, n, true);
+    cluster = end;
+  }
+  return true;
+}
+
+// Free the chain that starts at cluster. Links that stay in one FAT
+// block are followed and cleared under one cache lookup.
+uint8_t fatFreeRun(sd_volume* pvolume, uint32_t cluster) {
+  uint8_t shift = fatBlockShift(pvolume);
+  uint32_t mask = (1UL << shift) - 1;
+  for (;;) {
+    if (cluster < 2 || cluster > pvolume->clusterCount_ + 1) {
+      return false;
+    }
+    uint32_t block = cluster >> shift;
+    cache* fat = fatCacheBlock(pvolume, pvolume->fatStartBlock_ + block, CACHE_FOR_WRITE);
+    if (!fat) {
+      return false;
+    }
+    do {
+      uint32_t next = pvolume->fatType_ == 16 ? fat->fat16[cluster & mask] :
+                                                fat->fat32[cluster & mask] & FAT32MASK;
+      if (!isEOC(pvolume, next) && (next < 2 || next > pvolume->clusterCount_ + 1)) {
+        // free, reserved or bad cluster in the chain - leave it alone
+        return false;
+      }
+      if (pvolume->fatType_ == 16) {
+        fat->fat16[cluster & mask] = 0;
+      } else {
+        fat->fat32[cluster & mask] = 0;
+      }
+      fatRunChanged(pvolume, cluster, 1, false);
+      if (isEOC(pvolume, next)) {
+        return true;
+      }
+      cluster = next;
+    } while ((cluster >> shift) == block);
   }
-  cacheSetDirty(pvolume);
+}
 
-  // mirror second FAT
-  if (pvolume->fatCount_ > 1) {
-    pvolume->cacheMirrorBlock_ = lba + pvolume->blocksPerFat_;
+// Follow the chain from cluster and store up to max successors in next.
+// The last one stored is an EOC value if the chain ends. Links in one
+// FAT block are read under one cache lookup.
+uint8_t fatReadChainBatch(sd_volume* pvolume, uint32_t cluster, uint32_t* next, uint32_t max, uint32_t* count) {
+  uint8_t shift = fatBlockShift(pvolume);
+  uint32_t mask = (1UL << shift) - 1;
+  uint32_t n = 0;
+  while (n < max) {
+    if (cluster > pvolume->clusterCount_ + 1) {
+      return false;
+    }
+    uint32_t block = cluster >> shift;
+    cache* fat = fatCacheBlock(pvolume, pvolume->fatStartBlock_ + block, CACHE_FOR_READ);
+    if (!fat) {
+      return false;
+    }
+    do {
+      cluster = pvolume->fatType_ == 16 ? fat->fat16[cluster & mask] :
+                                          fat->fat32[cluster & mask] & FAT32MASK;
+      next[n++] = cluster;
+      if (isEOC(pvolume, cluster)) {
+        *count = n;
+        return true;
+      }
+    } while (n < max && (cluster >> shift) == block);
   }
+  *count = n;
   return true;
 }
 
@@ -221,5 +833,5 @@ uint8_t fatPutEOC(sd_volume* pvolume, uint32_t cluster) {
 }
 
 void cacheSetDirty(sd_volume* pvolume) {
-  pvolume->cacheDirty_ |= CACHE_FOR_WRITE;
+  pvolume->cacheCurrent_->dirty_ |= CACHE_FOR_WRITE;
 }
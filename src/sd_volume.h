@@ -4,6 +4,7 @@
 #include <pico/stdlib.h>
 #include <pico/binary_info.h>
 #include <hardware/spi.h>
+#include "block_dev.h"
 
 struct partitionTable {
   /**
@@ -245,6 +246,38 @@ struct directoryEntry {
 //
 /** Type name for directoryEntry */
 typedef struct directoryEntry dir_t;
+/** Characters of a long name held by one long name entry */
+#define LDIR_NAME_CHARS 13
+/** ord flag of the last part of a long name, its entry comes first */
+#define LDIR_ORD_LAST_LONG_ENTRY 0X40
+/**
+ * \struct longDirectoryEntry
+ * \brief FAT long name directory entry
+ *
+ * The entries of a long name come right before the short entry of the
+ * file, last part first. Characters are UTF-16, the name ends with a
+ * zero and the rest of its last part is filled with 0XFFFF.
+ */
+struct longDirectoryEntry {
+  /** Part of the name, from one, LDIR_ORD_LAST_LONG_ENTRY set in the last */
+  uint8_t  ord;
+  /** Characters 1-5 of the part */
+  uint16_t name1[5];
+  /** Must be DIR_ATT_LONG_NAME */
+  uint8_t  attr;
+  /** Zero for a long name entry */
+  uint8_t  type;
+  /** Checksum of the short name that follows the long name */
+  uint8_t  chksum;
+  /** Characters 6-11 of the part */
+  uint16_t name2[6];
+  /** Must be zero */
+  uint16_t mustBeZero;
+  /** Characters 12-13 of the part */
+  uint16_t name3[2];
+} __attribute__((packed));
+/** Type name for longDirectoryEntry */
+typedef struct longDirectoryEntry ldir_t;
 
 struct fat32BootSector {
   /** X86 jmp to boot program */
@@ -273,6 +306,35 @@ struct fat32BootSector {
   uint8_t  bootSectorSig1;
 } __attribute__((packed));
 //------------------------------------------------------------------------------
+/** Lead signature for a FSINFO sector */
+#define FSINFO_LEAD_SIG 0X41615252
+/** Struct signature for a FSINFO sector */
+#define FSINFO_STRUCT_SIG 0X61417272
+/** Value of free count and next free when not known */
+#define FSINFO_UNKNOWN 0XFFFFFFFF
+/**
+ * \struct fat32FSInfo
+ * \brief FSINFO sector for a FAT32 volume.
+ */
+struct fat32FSInfo {
+  /** must be 0X41615252 */
+  uint32_t leadSignature;
+  /** must be zero */
+  uint8_t  reserved1[480];
+  /** must be 0X61417272 */
+  uint32_t structSignature;
+  /** last known free cluster count, 0XFFFFFFFF if unknown */
+  uint32_t freeCount;
+  /** cluster to start looking for free clusters, 0XFFFFFFFF if unknown */
+  uint32_t nextFree;
+  /** must be zero */
+  uint8_t  reserved2[12];
+  /** must be 0XAA550000 */
+  uint32_t tailSignature;
+} __attribute__((packed));
+/** Type name for fat32FSInfo */
+typedef struct fat32FSInfo fsinfo_t;
+//------------------------------------------------------------------------------
 // End Of Chain values for FAT entries
 /** FAT16 end of chain value used by Microsoft. */
 #define FAT16EOC  0XFFFF
@@ -365,7 +427,7 @@ struct fat32BootSector {
 #define FAT_FILE_TYPE_MIN_DIR FAT_FILE_TYPE_ROOT16
 
 #define F_OFLAG = (O_ACCMODE | O_APPEND | O_SYNC);
-    // available bits
+    // writes and O_SYNC flushes do not wait for the card
 #define F_FILE_NON_BLOCKING_WRITE 0X10
     // a new cluster was added to the file
 #define F_FILE_CLUSTER_ADDED 0X20
@@ -391,6 +453,8 @@ union cache_t {
   mbr_t    mbr;
   /** Used to access to a cached FAT boot sector. */
   fbs_t    fbs;
+  /** Used to access to a cached FAT32 FSINFO sector. */
+  fsinfo_t fsinfo;
 };
 
 typedef union cache_t cache;
@@ -400,9 +464,89 @@ typedef union cache_t cache;
 // value for action argument in cacheRawBlock to indicate cache dirty
 #define CACHE_FOR_WRITE 1
 
+// number of blocks held by the volume cache, 512 bytes of RAM each
+#ifndef SD_CACHE_ENTRIES
+#define SD_CACHE_ENTRIES 4
+#endif
+// number of FAT blocks cached apart from data and directory blocks
+#ifndef SD_FAT_CACHE_ENTRIES
+#define SD_FAT_CACHE_ENTRIES 4
+#endif
+
+// directory entries remembered for path lookups
+#ifndef SD_DENTRY_ENTRIES
+#define SD_DENTRY_ENTRIES 8
+#endif
+
+/** One block of the volume cache */
+typedef struct __CACHE_ENTRY_PROT
+{
+  cache buffer_;
+  uint32_t blockNumber_;
+  // cacheClock_ at the last access, smallest is replaced first
+  uint32_t lastUse_;
+  uint8_t dirty_;
+} cache_entry;
+
+/** State of a FAT cache slot, the data is in fatCacheData_ */
+typedef struct __FAT_CACHE_SLOT_PROT
+{
+  // block in the first maintained FAT copy
+  uint32_t blockNumber_;
+  uint8_t dirty_;
+} fat_cache_slot;
+
+/** Where a name in a directory was found, see dentryFind() */
+typedef struct __SD_DENTRY_PROT
+{
+  // first cluster of the directory holding the entry, zero for a FAT16 root
+  uint32_t parent_;
+  // block of the entry, zero if the slot is unused
+  uint32_t dirBlock_;
+  // first cluster of a subdirectory
+  uint32_t firstCluster_;
+  uint32_t lastUse_;
+  uint8_t name_[11];
+  uint8_t dirIndex_;
+  uint8_t attributes_;
+} sd_dentry;
+
 typedef struct __SD_VOLUME_PROT
 {
-  cache cacheBuffer_;
+  cache_entry cacheEntries_[SD_CACHE_ENTRIES];
+  // entry of the block last returned by cacheRawBlock()
+  cache_entry* cacheCurrent_;
+  cache* cacheBuffer_;
+  uint32_t cacheBlockNumber_;
+  uint32_t cacheClock_;
+  uint32_t cacheHits_;
+  uint32_t cacheMisses_;
+  // FAT blocks, only used by fatGet() and fatPut(). A block goes in the
+  // slot given by its offset in the FAT, so neighbours are next to each
+  // other in fatCacheData_ and are written with one multi-block write.
+  cache fatCacheData_[SD_FAT_CACHE_ENTRIES];
+  fat_cache_slot fatCache_[SD_FAT_CACHE_ENTRIES];
+  uint32_t fatCacheHits_;
+  uint32_t fatCacheMisses_;
+  // FAT copies written, one if fat32Flags selects a single active FAT
+  uint8_t fatCopies_;
+  // optional bitmap of clusters in use, see fatBitmapInit()
+  uint32_t* bitmap_;
+  // one bit per FAT block, set once its clusters are in bitmap_
+  uint32_t* bitmapLoaded_;
+  // FSINFO block of a FAT32 volume, zero if none
+  uint32_t fsInfoBlock_;
+  // free clusters, FSINFO_UNKNOWN until counted
+  uint32_t freeClusterCount_;
+  // cluster where allocation starts looking for free clusters
+  uint32_t allocSearchStart_;
+  // free count or search start changed since FSINFO was written
+  uint8_t fsInfoDirty_;
+  // recently resolved names, least recently used is replaced first
+  sd_dentry dentries_[SD_DENTRY_ENTRIES];
+  uint32_t dentryClock_;
+  // bumped by each entry created and each cluster added to a directory
+  uint32_t dirChanges_;
   uint8_t fatCount_;
   uint8_t blocksPerCluster_;
   uint8_t clusterSizeShift_;
@@ -413,38 +557,53 @@ typedef struct __SD_VOLUME_PROT
   uint32_t dataStartBlock_;
   uint32_t clusterCount_;
   uint8_t fatType_;
-  uint8_t cacheDirty_;
-  uint32_t cacheBlockNumber_;
-  uint32_t cacheMirrorBlock_;
   uint8_t partition_;
+  // block device the volume is mounted on
+  block_dev* dev_;
 } sd_volume;
 
 
-inline uint8_t DIR_IS_LONG_NAME(const dir_t* dir) {
+static inline uint8_t DIR_IS_LONG_NAME(const dir_t* dir) {
   return (dir->attributes & DIR_ATT_LONG_NAME_MASK) == DIR_ATT_LONG_NAME;
 }
 /** Mask for file/subdirectory tests */
 #define DIR_ATT_FILE_TYPE_MASK (DIR_ATT_VOLUME_ID | DIR_ATT_DIRECTORY)
 /** Directory entry is for a file */
-inline uint8_t DIR_IS_FILE(const dir_t* dir) {
+static inline uint8_t DIR_IS_FILE(const dir_t* dir) {
   return (dir->attributes & DIR_ATT_FILE_TYPE_MASK) == 0;
 }
 /** Directory entry is for a subdirectory */
-inline uint8_t DIR_IS_SUBDIR(const dir_t* dir) {
+static inline uint8_t DIR_IS_SUBDIR(const dir_t* dir) {
   return (dir->attributes & DIR_ATT_FILE_TYPE_MASK) == DIR_ATT_DIRECTORY;
 }
 /** Directory entry is for a file or subdirectory */
-inline uint8_t DIR_IS_FILE_OR_SUBDIR(const dir_t* dir) {
+static inline uint8_t DIR_IS_FILE_OR_SUBDIR(const dir_t* dir) {
   return (dir->attributes & DIR_ATT_VOLUME_ID) == 0;
 }
 
 #ifdef __cplusplus
 extern "C" {
 #endif
-uint8_t sd_volume_init(sd_volume* pvolume);
+uint8_t sd_volume_init(sd_volume* pvolume, block_dev* dev);
+uint8_t devReadData(sd_volume* pvolume, uint32_t block, uint16_t offset, uint16_t count, uint8_t* dst);
+uint8_t devReadBlock(sd_volume* pvolume, uint32_t block, uint8_t* dst);
+uint8_t devWriteBlock(sd_volume* pvolume, uint32_t block, const uint8_t* src, uint8_t blocking);
+uint8_t devReadBlocks(sd_volume* pvolume, uint32_t block, uint32_t count, uint8_t* dst);
+uint8_t devWriteBlocks(sd_volume* pvolume, uint32_t block, uint32_t count, const uint8_t* src, uint8_t blocking);
+uint8_t devSync(sd_volume* pvolume);
+uint32_t devSectorCount(sd_volume* pvolume);
 uint8_t cacheRawBlock(sd_volume* pvolume, uint32_t blockNumber, uint8_t action);
-uint8_t cacheMirrorBlockFlush(sd_volume* pvolume, uint8_t blocking);
+uint8_t cacheClaimBlock(sd_volume* pvolume, uint32_t blockNumber);
+uint32_t cacheUncachedRun(sd_volume* pvolume, uint32_t blockNumber, uint32_t count);
 uint8_t cacheFlush(sd_volume* pvolume, uint8_t blocking);
+uint32_t cacheHits(sd_volume* pvolume);
+uint32_t cacheMisses(sd_volume* pvolume);
+uint32_t fatCacheHits(sd_volume* pvolume);
+uint32_t fatCacheMisses(sd_volume* pvolume);
+uint8_t freeClusterCount(sd_volume* pvolume, uint32_t* count);
+uint32_t fatBitmapWords(sd_volume* pvolume);
+uint8_t fatBitmapInit(sd_volume* pvolume, uint32_t* words, uint32_t wordCount);
+uint8_t fatBitmapFind(sd_volume* pvolume, uint32_t start, uint32_t count, uint32_t* first);
 uint8_t fatType(sd_volume* pvolume);
 uint32_t rootDirEntryCount(sd_volume* pvolume);
 uint32_t rootDirStart(sd_volume* pvolume);
@@ -452,7 +611,14 @@ uint8_t chainSize(sd_volume* pvolume, uint32_t cluster, uint32_t* size);
 uint8_t fatGet(sd_volume* pvolume, uint32_t cluster, uint32_t* value);
 uint8_t fatPut(sd_volume* pvolume, uint32_t cluster, uint32_t value);
 uint8_t fatPutEOC(sd_volume* pvolume, uint32_t cluster);
+uint8_t fatLinkRun(sd_volume* pvolume, uint32_t first, uint32_t count);
+uint8_t fatFreeRun(sd_volume* pvolume, uint32_t cluster);
+uint8_t fatReadChainBatch(sd_volume* pvolume, uint32_t cluster, uint32_t* next, uint32_t max, uint32_t* count);
 void cacheSetDirty(sd_volume* pvolume);
+sd_dentry* dentryFind(sd_volume* pvolume, uint32_t parent, const uint8_t* name);
+void dentryInsert(sd_volume* pvolume, uint32_t parent, const uint8_t* name,
+                  uint32_t dirBlock, uint8_t dirIndex, uint8_t attributes, uint32_t firstCluster);
+void dentryClear(sd_volume* pvolume);
 #ifdef __cplusplus
 }
 #endif